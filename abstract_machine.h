@@ -222,6 +222,11 @@ struct abstract_machine {
     return val;
   }
 
+  // Sets V for the addition of operand to a giving result.
+  z3::expr setV(z3::expr const & a, z3::expr const & operand, z3::expr const & result) {
+    return ccV(0x80 == (0x80 & (result ^ a) & (result ^ operand)));
+  }
+
   z3::context& c;
 
   // The boolean values, as z3 exprs.
@@ -255,6 +260,12 @@ struct abstract_machine {
   z3::expr _ccD; z3::expr ccD(z3::expr const & val) { return _ccD = E(val, _ccD); }
   z3::expr _ccC; z3::expr ccC(z3::expr const & val) { return _ccC = E(val, _ccC); }
   z3::expr _ccZ; z3::expr ccZ(z3::expr const & val) { return _ccZ = E(val, _ccZ); }
+  z3::expr ccS() const { return _ccS; }
+  z3::expr ccV() const { return _ccV; }
+  z3::expr ccI() const { return _ccI; }
+  z3::expr ccD() const { return _ccD; }
+  z3::expr ccC() const { return _ccC; }
+  z3::expr ccZ() const { return _ccZ; }
 
   z3::expr _memory;
 
@@ -0,0 +1,455 @@
+#pragma once
+
+#include <stdexcept>
+#include "instructions2.h"
+#include "random_machine.h"
+
+/**
+ * A boolean for each of 64 machines. Bit i is the value for machine i.
+ */
+typedef struct lane_mask {
+  uint64_t bits;
+
+  lane_mask operator!() const { return lane_mask { ~bits }; }
+  lane_mask operator~() const { return lane_mask { ~bits }; }
+  lane_mask operator&(const lane_mask &other) const { return lane_mask { bits & other.bits }; }
+  lane_mask operator|(const lane_mask &other) const { return lane_mask { bits | other.bits }; }
+  lane_mask operator^(const lane_mask &other) const { return lane_mask { bits ^ other.bits }; }
+} lane_mask;
+
+/**
+ * An N-bit value for each of 64 machines, stored bitsliced:
+ * bit[i] holds bit i of every machine's value, with machine j
+ * in bit j of the word. Arithmetic is done with bitwise operations
+ * on the words, so every operation runs on all 64 machines at once.
+ */
+template<int N>
+struct bitslice {
+  uint64_t bit[N];
+
+  // The same value in every lane.
+  static bitslice constant(uint32_t value) {
+    bitslice result;
+    for (int i = 0; i < N; i++) {
+      result.bit[i] = ((value >> i) & 1) ? ~0ull : 0;
+    }
+    return result;
+  }
+
+  uint32_t get(int lane) const {
+    uint32_t result = 0;
+    for (int i = 0; i < N; i++) {
+      result |= (uint32_t)((bit[i] >> lane) & 1) << i;
+    }
+    return result;
+  }
+
+  void set(int lane, uint32_t value) {
+    for (int i = 0; i < N; i++) {
+      bit[i] = (bit[i] & ~(1ull << lane)) | ((uint64_t)((value >> i) & 1) << lane);
+    }
+  }
+};
+
+// Ripple carry adder. carry is the carry into bit 0 for each lane;
+// the carry out of the top bit is returned in carry.
+template<int N>
+inline bitslice<N> add(const bitslice<N> &a, const bitslice<N> &b, uint64_t &carry) {
+  bitslice<N> result;
+  for (int i = 0; i < N; i++) {
+    uint64_t half = a.bit[i] ^ b.bit[i];
+    result.bit[i] = half ^ carry;
+    carry = (a.bit[i] & b.bit[i]) | (carry & half);
+  }
+  return result;
+}
+
+template<int N>
+inline bitslice<N> mux(const lane_mask &cond, const bitslice<N> &conseq, const bitslice<N> &alter) {
+  bitslice<N> result;
+  for (int i = 0; i < N; i++) {
+    result.bit[i] = (cond.bits & conseq.bit[i]) | (~cond.bits & alter.bit[i]);
+  }
+  return result;
+}
+
+template<int N>
+inline bitslice<N> operator~(const bitslice<N> &a) {
+  bitslice<N> result;
+  for (int i = 0; i < N; i++) { result.bit[i] = ~a.bit[i]; }
+  return result;
+}
+
+#define BITWISE_OP(op) \
+template<int N> \
+inline bitslice<N> operator op(const bitslice<N> &a, const bitslice<N> &b) { \
+  bitslice<N> result; \
+  for (int i = 0; i < N; i++) { result.bit[i] = a.bit[i] op b.bit[i]; } \
+  return result; \
+} \
+template<int N> \
+inline bitslice<N> operator op(const bitslice<N> &a, uint32_t b) { return a op bitslice<N>::constant(b); } \
+template<int N> \
+inline bitslice<N> operator op(uint32_t a, const bitslice<N> &b) { return bitslice<N>::constant(a) op b; }
+
+BITWISE_OP(&)
+BITWISE_OP(|)
+BITWISE_OP(^)
+#undef BITWISE_OP
+
+template<int N>
+inline bitslice<N> operator+(const bitslice<N> &a, const bitslice<N> &b) {
+  uint64_t carry = 0;
+  return add(a, b, carry);
+}
+
+template<int N>
+inline bitslice<N> operator+(const bitslice<N> &a, uint32_t b) {
+  return a + bitslice<N>::constant(b);
+}
+
+template<int N>
+inline bitslice<N> operator-(const bitslice<N> &a, const bitslice<N> &b) {
+  uint64_t carry = ~0ull;
+  return add(a, ~b, carry);
+}
+
+template<int N>
+inline bitslice<N> operator-(const bitslice<N> &a, uint32_t b) {
+  return a - bitslice<N>::constant(b);
+}
+
+// Shifts are just moves between the words.
+template<int N>
+inline bitslice<N> operator<<(const bitslice<N> &a, int amount) {
+  bitslice<N> result;
+  for (int i = 0; i < N; i++) { result.bit[i] = i >= amount ? a.bit[i - amount] : 0; }
+  return result;
+}
+
+template<int N>
+inline bitslice<N> operator>>(const bitslice<N> &a, int amount) {
+  bitslice<N> result;
+  for (int i = 0; i < N; i++) { result.bit[i] = i + amount < N ? a.bit[i + amount] : 0; }
+  return result;
+}
+
+template<int N>
+inline lane_mask operator==(const bitslice<N> &a, const bitslice<N> &b) {
+  uint64_t result = ~0ull;
+  for (int i = 0; i < N; i++) { result &= ~(a.bit[i] ^ b.bit[i]); }
+  return lane_mask { result };
+}
+
+template<int N>
+inline lane_mask operator==(const bitslice<N> &a, uint32_t b) { return a == bitslice<N>::constant(b); }
+
+template<int N>
+inline lane_mask operator==(uint32_t a, const bitslice<N> &b) { return bitslice<N>::constant(a) == b; }
+
+/**
+ * bitsliced_machine runs 64 random_machines at once. Every register
+ * is bitsliced, so one emulated instruction evaluates 64 independent
+ * initial states with only bitwise operations.
+ *
+ * Lane i behaves exactly like the random_machine it was built from,
+ * including the hash it produces.
+ */
+struct bitsliced_machine {
+  static constexpr int lanes = 64;
+  static const bool falsy = false;
+  static const bool truthy = true;
+
+  typedef bitslice<8> byte;
+  typedef bitslice<16> word;
+
+  bitsliced_machine() {}
+
+  bitsliced_machine(const random_machine (&machines)[lanes]) {
+    memset(this, 0, sizeof(*this));
+    for (int i = 0; i < lanes; i++) {
+      const random_machine &m = machines[i];
+      initLow.set(i, m.init);
+      setLane(seedZero, i, m.seed == 0);
+      setLane(seedOnes, i, m.seed == 0xFFFFFFFF);
+      for (int j = 0; j < 4; j++) {
+        absoluteVars[j].set(i, m.absoluteVars[j]);
+        zpVars[j].set(i, m.zpVars[j]);
+        immediateVars[j].set(i, m.immediateVars[j]);
+      }
+      _a.set(i, m._a);
+      _x.set(i, m._x);
+      _y.set(i, m._y);
+      _sp.set(i, m._sp);
+      setLane(_ccS, i, m.ccS());
+      setLane(_ccV, i, m.ccV());
+      setLane(_ccI, i, m.ccI());
+      setLane(_ccD, i, m.ccD());
+      setLane(_ccC, i, m.ccC());
+      setLane(_ccZ, i, m.ccZ());
+      earlyExit.set(i, m.earlyExit);
+      if (m.numAddressesWritten != 0 || !m.spilledWrites.empty()) {
+        throw std::invalid_argument("bitsliced_machine starts from machines with empty write logs");
+      }
+    }
+    live = earlyExit == 0;
+  }
+
+  word absoluteVars[4];
+  word absolute(uint8_t number) const {
+    return absoluteVars[number];
+  }
+
+  byte zpVars[4];
+  byte zp(uint8_t number) const {
+    return zpVars[number];
+  }
+
+  byte immediateVars[4];
+  byte immediate(uint8_t number) const {
+    return immediateVars[number];
+  }
+
+  byte constant(uint8_t number) const {
+    return byte::constant(number);
+  }
+
+  void instruction(instruction op) {
+    emulator<bitsliced_machine> emu;
+    emu.instruction(*this, op);
+  }
+
+  // The low byte of each lane's fnv state, and which lanes have
+  // the special all-zero and all-one seeds.
+  byte initLow;
+  lane_mask seedZero;
+  lane_mask seedOnes;
+
+  bitslice<17> earlyExit;
+  // Lanes which haven't exited yet. Only these lanes are changed.
+  lane_mask live;
+
+  // Write log slot i holds one address per lane. writtenLanes[i] marks
+  // which lanes actually wrote it; the others are unused.
+  static_assert(NUM_ADDRESSES >= 7, "Every write of a 7 instruction sequence must fit in the log");
+  word writtenAddresses[NUM_ADDRESSES];
+  byte writtenValues[NUM_ADDRESSES];
+  lane_mask writtenLanes[NUM_ADDRESSES];
+  uint8_t numSlots = 0;
+
+  byte _a;
+  byte _x;
+  byte _y;
+  byte _sp;
+  lane_mask _ccS;
+  lane_mask _ccV;
+  lane_mask _ccI;
+  lane_mask _ccD;
+  lane_mask _ccC;
+  lane_mask _ccZ;
+
+  static void setLane(lane_mask &mask, int lane, bool val) {
+    mask.bits = (mask.bits & ~(1ull << lane)) | ((uint64_t)val << lane);
+  }
+
+  // Exits every live lane where cond is set with the given code.
+  void exit(lane_mask cond, const bitslice<17> &code) {
+    earlyExit = mux(cond & live, code, earlyExit);
+    live = earlyExit == 0;
+  }
+
+  void rts() {
+    exit(lane_mask { ~0ull }, bitslice<17>::constant(0x0001));
+  }
+  void rti() {
+    exit(lane_mask { ~0ull }, bitslice<17>::constant(0x0002));
+  }
+  void jmp(const word &target) {
+    exit(lane_mask { ~0ull }, jumpCode(target));
+  }
+  void branch(lane_mask cond, const word &target) {
+    exit(cond, jumpCode(target));
+  }
+
+  static bitslice<17> jumpCode(const word &target) {
+    bitslice<17> code;
+    for (int i = 0; i < 16; i++) { code.bit[i] = target.bit[i]; }
+    code.bit[16] = ~0ull;
+    return code;
+  }
+
+  // Every assignment only affects the lanes which haven't exited.
+  byte a(const byte &val) { return _a = mux(live, val, _a); }
+  byte x(const byte &val) { return _x = mux(live, val, _x); }
+  byte y(const byte &val) { return _y = mux(live, val, _y); }
+  byte sp(const byte &val) { return _sp = mux(live, val, _sp); }
+  lane_mask flag(lane_mask &cc, lane_mask val) {
+    return cc = (live & val) | (~live & cc);
+  }
+  lane_mask ccS(lane_mask val) { return flag(_ccS, val); }
+  lane_mask ccV(lane_mask val) { return flag(_ccV, val); }
+  lane_mask ccI(lane_mask val) { return flag(_ccI, val); }
+  lane_mask ccD(lane_mask val) { return flag(_ccD, val); }
+  lane_mask ccC(lane_mask val) { return flag(_ccC, val); }
+  lane_mask ccZ(lane_mask val) { return flag(_ccZ, val); }
+  lane_mask ccS(bool val) { return ccS(lane_mask { val ? ~0ull : 0 }); }
+  lane_mask ccV(bool val) { return ccV(lane_mask { val ? ~0ull : 0 }); }
+  lane_mask ccI(bool val) { return ccI(lane_mask { val ? ~0ull : 0 }); }
+  lane_mask ccD(bool val) { return ccD(lane_mask { val ? ~0ull : 0 }); }
+  lane_mask ccC(bool val) { return ccC(lane_mask { val ? ~0ull : 0 }); }
+  lane_mask ccZ(bool val) { return ccZ(lane_mask { val ? ~0ull : 0 }); }
+  lane_mask ccS() const { return _ccS; }
+  lane_mask ccV() const { return _ccV; }
+  lane_mask ccI() const { return _ccI; }
+  lane_mask ccD() const { return _ccD; }
+  lane_mask ccC() const { return _ccC; }
+  lane_mask ccZ() const { return _ccZ; }
+
+  // Multiplies by the fnv prime, modulo 256. 16777619 & 0xFF == 0x93.
+  static byte fnvPrime(const byte &val) {
+    return val + (val << 1) + (val << 4) + (val << 7);
+  }
+
+  // The low byte of fnv(addr) for every lane. Only the low byte
+  // of each step affects the low byte of the result, so this can
+  // be computed with 8-bit bitsliced arithmetic.
+  byte initial(const word &addr) const {
+    byte hash = fnvPrime(initLow ^ lobyte(addr));
+    hash = fnvPrime(hash ^ hibyte(addr));
+    hash = mux(seedZero, byte::constant(0x00), hash);
+    return mux(seedOnes, byte::constant(0xFF), hash);
+  }
+
+  byte read(const word &addr) const {
+    byte result = initial(addr);
+    for (int i = 0; i < numSlots; i++) {
+      result = mux(writtenLanes[i] & (writtenAddresses[i] == addr), writtenValues[i], result);
+    }
+    return result;
+  }
+
+  byte setSZ(const byte &val) {
+    ccS(lane_mask { val.bit[7] });
+    ccZ(val == 0);
+    return val;
+  }
+
+  // Sets V for the addition of operand to a giving result.
+  lane_mask setV(const byte &a, const byte &operand, const byte &result) {
+    return ccV(lane_mask { (result.bit[7] ^ a.bit[7]) & (result.bit[7] ^ operand.bit[7]) });
+  }
+
+  // The carry out of first - second is set when there was no borrow.
+  lane_mask uge(const byte &first, const byte &second) const {
+    uint64_t carry = ~0ull;
+    add(first, ~second, carry);
+    return lane_mask { carry };
+  }
+
+  lane_mask uge(const byte &first, uint8_t second) const {
+    return uge(first, byte::constant(second));
+  }
+
+  byte inline ite(lane_mask cond, const byte &conseq, const byte &alter) const {
+    return mux(cond, conseq, alter);
+  }
+
+  byte inline ite(lane_mask cond, uint8_t conseq, uint8_t alter) const {
+    return mux(cond, byte::constant(conseq), byte::constant(alter));
+  }
+
+  byte inline shl(const byte &val) const {
+    return val << 1;
+  }
+
+  byte inline shr(const byte &val) const {
+    return val >> 1;
+  }
+
+  byte inline lobyte(const word &val) const {
+    byte result;
+    for (int i = 0; i < 8; i++) { result.bit[i] = val.bit[i]; }
+    return result;
+  }
+
+  byte inline hibyte(const word &val) const {
+    byte result;
+    for (int i = 0; i < 8; i++) { result.bit[i] = val.bit[i + 8]; }
+    return result;
+  }
+
+  word extend(const byte &val) const {
+    word result = word::constant(0);
+    for (int i = 0; i < 8; i++) { result.bit[i] = val.bit[i]; }
+    return result;
+  }
+
+  // Updates the lane's entry if it already wrote to the address,
+  // otherwise adds a new slot for the remaining lanes.
+  byte write(const word &addr, const byte &val) {
+    lane_mask pending = live;
+    for (int i = 0; i < numSlots; i++) {
+      lane_mask hit = pending & writtenLanes[i] & (writtenAddresses[i] == addr);
+      writtenValues[i] = mux(hit, val, writtenValues[i]);
+      pending = pending & ~hit;
+    }
+    if (pending.bits != 0) {
+      // There's nowhere to spill to, as in random_machine_x16.
+      if (numSlots == NUM_ADDRESSES) {
+        throw std::length_error("bitsliced_machine wrote more than NUM_ADDRESSES addresses");
+      }
+      writtenAddresses[numSlots] = addr;
+      writtenValues[numSlots] = val;
+      writtenLanes[numSlots] = pending;
+      numSlots++;
+    }
+    return val;
+  }
+
+  /**
+   * Returns a hash of the state of all 64 machines. It follows the
+   * same rule as random_machine::hash(): equivalent instruction
+   * sequences run on the same initial machines give the same hash.
+   *
+   * The bitsliced words are hashed directly rather than one machine
+   * at a time, which would need the state to be transposed. Written
+   * memory that still holds its initial value is left out.
+   */
+  uint64_t hash(uint64_t seed = 14695981039346656037u) const {
+    uint64_t hash = seed;
+#define h(var) hash = (hash ^ (var)) * 0x9E3779B97F4A7C15u; hash ^= hash >> 32
+    for (int i = 0; i < 8; i++) {
+      h(_a.bit[i]);
+      h(_x.bit[i]);
+      h(_y.bit[i]);
+      h(_sp.bit[i]);
+    }
+    h(_ccS.bits);
+    h(_ccV.bits);
+    h(_ccI.bits);
+    h(_ccD.bits);
+    h(_ccC.bits);
+    h(_ccZ.bits);
+
+    // For each changed address hash the address and value,
+    // in the lanes where it changed.
+    for (int slot = 0; slot < numSlots; slot++) {
+      const word &address = writtenAddresses[slot];
+      const byte &value = writtenValues[slot];
+      const uint64_t changed = (writtenLanes[slot] & ~(value == initial(address))).bits;
+      if (changed == 0) { continue; }
+      h(changed);
+      for (int i = 0; i < 16; i++) {
+        h(address.bit[i] & changed);
+      }
+      for (int i = 0; i < 8; i++) {
+        h(value.bit[i] & changed);
+      }
+    }
+    for (int i = 0; i < 17; i++) {
+      h(earlyExit.bit[i]);
+    }
+#undef h
+    return hash;
+  }
+};
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <vector>
+#include "stdint.h"
+#include "instructions2.h"
+
+/**
+ * Operands are unknowns, named by the instruction's number: absolute0-3,
+ * zp0-3 and immediate0-3. Renaming them gives a sequence that does the
+ * same thing to other unknowns, and running it is the same as running
+ * the original on a machine with those unknowns swapped. So only one
+ * sequence of each renaming has to be enumerated: the canonical one,
+ * where the first absolute is absolute0, the next new one is absolute1,
+ * and so on for each kind.
+ */
+
+// The kind of unknown that an addressing mode names, or -1 for the
+// modes that don't name one. Constants are values, not names, and are
+// never renamed.
+inline int operand_kind(addr_mode mode) {
+  switch (mode) {
+  case addr_mode::ABSOLUTE:
+  case addr_mode::ABSOLUTE_X:
+  case addr_mode::ABSOLUTE_Y:
+    return 0;
+  case addr_mode::X_INDIRECT:
+  case addr_mode::INDIRECT_Y:
+  case addr_mode::ZERO_PAGE:
+  case addr_mode::ZERO_PAGE_X:
+  case addr_mode::ZERO_PAGE_Y:
+    return 1;
+  case addr_mode::IMMEDIATE:
+    return 2;
+  default:
+    return -1;
+  }
+}
+
+// For each kind of unknown, the new name of each old name.
+typedef std::array<std::array<uint8_t, 4>, 3> operand_renaming;
+
+inline operand_renaming identity_renaming() {
+  operand_renaming renaming;
+  for (auto &names : renaming) {
+    names = {{ 0, 1, 2, 3 }};
+  }
+  return renaming;
+}
+
+inline instruction_seq rename_operands(const instruction_seq &seq, const operand_renaming &renaming) {
+  instruction_seq result = seq;
+  for (auto &ins : result.instructions) {
+    int kind = operand_kind(ins.mode());
+    if (kind >= 0) {
+      ins = ins.number(renaming[kind][ins.number() & 3]);
+    }
+  }
+  return result;
+}
+
+// A bit for each name of each kind that the sequence uses.
+inline std::array<uint8_t, 3> used_operands(const instruction_seq &seq) {
+  std::array<uint8_t, 3> used = {{ 0, 0, 0 }};
+  for (const auto &ins : seq.instructions) {
+    int kind = operand_kind(ins.mode());
+    if (kind >= 0) {
+      used[kind] |= 1 << (ins.number() & 3);
+    }
+  }
+  return used;
+}
+
+inline instruction_seq canonicalize(const instruction_seq &seq) {
+  operand_renaming renaming = identity_renaming();
+  std::array<uint8_t, 3> next = {{ 0, 0, 0 }};
+  std::array<uint8_t, 3> seen = {{ 0, 0, 0 }};
+  for (const auto &ins : seq.instructions) {
+    int kind = operand_kind(ins.mode());
+    if (kind < 0) { continue; }
+    uint8_t name = ins.number() & 3;
+    if (!(seen[kind] & (1 << name))) {
+      seen[kind] |= 1 << name;
+      renaming[kind][name] = next[kind]++;
+    }
+  }
+  return rename_operands(seq, renaming);
+}
+
+inline bool is_canonical(const instruction_seq &seq) {
+  const instruction_seq canonical = canonicalize(seq);
+  for (int i = 0; i < 7; i++) {
+    if (canonical.instructions[i].data != seq.instructions[i].data) { return false; }
+  }
+  return true;
+}
+
+/**
+ * Whether adding the instruction to a canonical sequence keeps it
+ * canonical: its unknown has to be one the sequence already uses, or
+ * the next new one.
+ */
+inline bool extends_canonically(const instruction_seq &seq, instruction ins) {
+  int kind = operand_kind(ins.mode());
+  if (kind < 0) { return true; }
+  uint8_t used = used_operands(seq)[kind];
+  int count = 0;
+  for (; used; used >>= 1) {
+    count += used & 1;
+  }
+  return ins.number() <= count;
+}
+
+/**
+ * Every way of swapping around the unknowns that the sequence uses,
+ * starting with leaving them as they are. A sequence that behaves like
+ * some renaming of this one only needs unknowns that this one uses, so
+ * it's the same as one of these renamed.
+ */
+inline std::vector<operand_renaming> renamings(const instruction_seq &seq) {
+  const std::array<uint8_t, 3> used = used_operands(seq);
+  std::vector<operand_renaming> result(1, identity_renaming());
+  for (int kind = 0; kind < 3; kind++) {
+    std::vector<operand_renaming> combined;
+    for (const auto &renaming : result) {
+      // Each of the 256 maps from 4 names to 4 names, two bits a name,
+      // that is a permutation and only moves the used names. 0xE4 is
+      // the identity, so it comes first.
+      for (int i = 0; i < 256; i++) {
+        int map = (0xE4 + i) & 0xFF;
+        operand_renaming next = renaming;
+        uint8_t hit = 0;
+        bool moves_unused = false;
+        for (int name = 0; name < 4; name++) {
+          uint8_t to = (map >> (2 * name)) & 3;
+          next[kind][name] = to;
+          hit |= 1 << to;
+          moves_unused |= !(used[kind] & (1 << name)) && to != name;
+        }
+        if (hit == 0xF && !moves_unused) {
+          combined.push_back(next);
+        }
+      }
+    }
+    result.swap(combined);
+  }
+  return result;
+}
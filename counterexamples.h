@@ -0,0 +1,227 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include "stdint.h"
+#include "z3++.h"
+#include "instructions2.h"
+#include "emulator2.h"
+#include "random_machine.h"
+#include "abstract_machine.h"
+#include "fnv.h"
+
+/**
+ * Initial machine states that z3 found to tell two sequences apart.
+ *
+ * When the solver says two sequences with the same fingerprint can
+ * end up different, its model is a concrete starting state that
+ * shows it. Those states are kept here as random_machines and saved
+ * to a file, so the set carries over from run to run. Pairs that any
+ * of the states already tell apart never need to go to the solver
+ * again.
+ *
+ * Every pair is run on the states until one tells it apart, so the
+ * set is capped at max_machines and kept in order of use: a state
+ * that tells a pair apart moves one place towards the front, and once
+ * the set is full a new state replaces the last one.
+ */
+typedef struct counterexample_set {
+  static const size_t max_machines = 256;
+
+  std::string file_name;
+  std::vector<random_machine> machines;
+  // The number of machines ever learned, which seeds the next one.
+  uint32_t learned = 0;
+
+  counterexample_set(const std::string &file_name) : file_name(file_name) {
+    std::ifstream file(file_name, std::ifstream::binary | std::ifstream::in);
+    random_machine machine;
+    while (load(file, machine)) {
+      if (machines.size() < max_machines) { machines.push_back(machine); }
+      learned++;
+    }
+  }
+
+  /**
+   * True if one of the known machines ends in a different state
+   * after running each of the sequences.
+   */
+  bool distinguishes(const compiled_sequence<random_machine> &a, const compiled_sequence<random_machine> &b) {
+    for (size_t i = 0; i < machines.size(); i++) {
+      if (distinguishes(machines[i], a, b)) {
+        if (i > 0) { std::swap(machines[i], machines[i - 1]); }
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool distinguishes(const random_machine &machine, const compiled_sequence<random_machine> &a, const compiled_sequence<random_machine> &b) {
+    random_machine ma = machine;
+    random_machine mb = machine;
+    a.run(ma);
+    b.run(mb);
+    return !ma.same_state(mb);
+  }
+
+  /**
+   * Turns a sat model from comparing a and b into a machine, and keeps
+   * it if it really does tell the sequences apart. Returns whether it
+   * was kept. The set isn't saved until save() is called.
+   *
+   * Memory is only copied for the addresses the model lists; the rest
+   * of memory keeps the machine's fnv values. Models that depend on
+   * the rest of memory won't reproduce, and are dropped.
+   */
+  bool learn(const z3::model &model, const compiled_sequence<random_machine> &a, const compiled_sequence<random_machine> &b) {
+    random_machine machine = from_model(model, learned++);
+    if (!distinguishes(machine, a, b)) {
+      return false;
+    }
+    if (machines.size() < max_machines) {
+      machines.push_back(machine);
+    } else {
+      machines.back() = machine;
+    }
+    return true;
+  }
+
+  // Rewrites the file with the machines in the set, in order of use.
+  void save() const {
+    std::ofstream file(file_name, std::ofstream::binary | std::ofstream::out | std::ofstream::trunc);
+    for (const auto &machine : machines) {
+      save(file, machine);
+    }
+  }
+
+  static random_machine from_model(const z3::model &model, uint32_t index) {
+    z3::context &c = model.ctx();
+    // A fresh abstract_machine has the same names for its initial state
+    // as the machines that were compared.
+    abstract_machine initial(c);
+    random_machine machine(fnv_hash(0xC0DE).add(index).hash32());
+
+    auto value = [&](const z3::expr &e) {
+      return model.eval(e, true).get_numeral_uint();
+    };
+    auto flag = [&](const z3::expr &e) {
+      return model.eval(e, true).bool_value() == Z3_L_TRUE;
+    };
+
+    machine._a = value(initial._a);
+    machine._x = value(initial._x);
+    machine._y = value(initial._y);
+    machine._sp = value(initial._sp);
+    machine._ccS = flag(initial._ccS);
+    machine._ccV = flag(initial._ccV);
+    machine._ccI = flag(initial._ccI);
+    machine._ccD = flag(initial._ccD);
+    machine._ccC = flag(initial._ccC);
+    machine._ccZ = flag(initial._ccZ);
+    for (int i = 0; i < 4; i++) {
+      machine.absoluteVars[i] = value(initial.absoluteVars[i]);
+      machine.zpVars[i] = value(initial.zpVars[i]);
+      machine.immediateVars[i] = value(initial.immediateVars[i]);
+    }
+
+    // The memory is either a chain of stores, with the latest store
+    // outermost, or a function interpretation.
+    z3::expr memory = model.eval(initial._memory, true);
+    while (memory.decl().decl_kind() == Z3_OP_STORE) {
+      uint16_t addr = memory.arg(1).get_numeral_uint();
+      if (machine.findWritten(addr) < 0) {
+        machine.write(addr, memory.arg(2).get_numeral_uint());
+      }
+      memory = memory.arg(0);
+    }
+    if (Z3_is_as_array(c, memory)) {
+      z3::func_decl f(c, Z3_get_as_array_func_decl(c, memory));
+      z3::func_interp interp = model.get_func_interp(f);
+      for (unsigned i = 0; i < interp.num_entries(); i++) {
+        z3::func_entry entry = interp.entry(i);
+        uint16_t addr = entry.arg(0).get_numeral_uint();
+        if (machine.findWritten(addr) < 0) {
+          machine.write(addr, entry.value().get_numeral_uint());
+        }
+      }
+    }
+    return machine;
+  }
+
+  // The file is a list of records:
+  //   seed (4), a, x, y, sp, flags (1), absolute vars (4*2), zp vars (4),
+  //   immediate vars (4), memory count (1), then (address (2), value (1))
+  //   for each memory entry.
+  static void save(std::ostream &out, const random_machine &machine) {
+    std::vector<uint8_t> buffer;
+    for (int i = 0; i < 4; i++) {
+      buffer.push_back(machine.seed >> (8 * i));
+    }
+    buffer.push_back(machine._a);
+    buffer.push_back(machine._x);
+    buffer.push_back(machine._y);
+    buffer.push_back(machine._sp);
+    buffer.push_back(
+      machine.ccS() << 0 | machine.ccV() << 1 | machine.ccI() << 2 |
+      machine.ccD() << 3 | machine.ccC() << 4 | machine.ccZ() << 5);
+    for (int i = 0; i < 4; i++) {
+      buffer.push_back(machine.absoluteVars[i]);
+      buffer.push_back(machine.absoluteVars[i] >> 8);
+    }
+    for (int i = 0; i < 4; i++) {
+      buffer.push_back(machine.zpVars[i]);
+    }
+    for (int i = 0; i < 4; i++) {
+      buffer.push_back(machine.immediateVars[i]);
+    }
+    std::vector<std::pair<uint16_t, uint8_t>> memory(machine.spilledWrites);
+    for (int i = machine.numAddressesWritten - 1; i >= 0; i--) {
+      memory.insert(memory.begin(), std::make_pair(machine.writtenAddresses[i], machine.writtenValues[i]));
+    }
+    if (memory.size() > 255) { memory.resize(255); }
+    buffer.push_back(memory.size());
+    for (const auto &entry : memory) {
+      buffer.push_back(entry.first);
+      buffer.push_back(entry.first >> 8);
+      buffer.push_back(entry.second);
+    }
+    out.write((const char*)buffer.data(), buffer.size());
+  }
+
+  static bool load(std::istream &in, random_machine &machine) {
+    uint8_t header[26];
+    in.read((char*)header, sizeof(header));
+    if (!in.good()) { return false; }
+    uint8_t *p = header;
+    machine = random_machine(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+    p += 4;
+    machine._a = *p++;
+    machine._x = *p++;
+    machine._y = *p++;
+    machine._sp = *p++;
+    uint8_t flags = *p++;
+    machine._ccS = flags & 0x01;
+    machine._ccV = flags & 0x02;
+    machine._ccI = flags & 0x04;
+    machine._ccD = flags & 0x08;
+    machine._ccC = flags & 0x10;
+    machine._ccZ = flags & 0x20;
+    for (int i = 0; i < 4; i++, p += 2) {
+      machine.absoluteVars[i] = p[0] | p[1] << 8;
+    }
+    for (int i = 0; i < 4; i++) {
+      machine.zpVars[i] = *p++;
+    }
+    for (int i = 0; i < 4; i++) {
+      machine.immediateVars[i] = *p++;
+    }
+    uint8_t entries[255 * 3];
+    in.read((char*)entries, *p * 3);
+    if (!in.good()) { return false; }
+    for (int i = 0; i < *p; i++) {
+      machine.write(entries[3*i] | entries[3*i + 1] << 8, entries[3*i + 2]);
+    }
+    return true;
+  }
+} counterexample_set;
@@ -0,0 +1,362 @@
+#pragma once
+
+#include "stdint.h"
+#include "instructions2.h"
+
+/**
+ * What each instruction reads and writes, so that the enumerator can
+ * tell when two instructions don't depend on each other. Swapping two
+ * neighbouring instructions that don't gives a sequence that does
+ * exactly the same thing, so of all the orders of a sequence's
+ * dependency graph, only one needs to be enumerated.
+ *
+ * The sets cover what both the emulator and a real 6502 do: TSX and
+ * PLA set S and Z, and ADC and SBC read D, even though the emulator
+ * doesn't model it. Memory is one resource, since the unknown
+ * addresses may be the same. Every instruction is skipped once the
+ * sequence has exited, so every instruction reads `exit`, and nothing
+ * moves past a branch, jump or return.
+ */
+enum resource : uint16_t {
+  resource_a = 1 << 0,
+  resource_x = 1 << 1,
+  resource_y = 1 << 2,
+  resource_sp = 1 << 3,
+  resource_s = 1 << 4,
+  resource_v = 1 << 5,
+  resource_d = 1 << 6,
+  resource_i = 1 << 7,
+  resource_z = 1 << 8,
+  resource_c = 1 << 9,
+  resource_memory = 1 << 10,
+  resource_exit = 1 << 11,
+
+  resource_flags = resource_s | resource_v | resource_d | resource_i | resource_z | resource_c,
+};
+
+typedef struct instruction_effects {
+  uint16_t reads;
+  uint16_t writes;
+} instruction_effects;
+
+inline instruction_effects effects(instruction ins) {
+  uint16_t reads = resource_exit;
+  uint16_t writes = 0;
+
+  // The operand's address, and the value at it.
+  const addr_mode mode = ins.mode();
+  switch (mode) {
+  case addr_mode::ABSOLUTE_X:
+  case addr_mode::ZERO_PAGE_X:
+  case addr_mode::X_INDIRECT:
+    reads |= resource_x;
+    break;
+  case addr_mode::ABSOLUTE_Y:
+  case addr_mode::ZERO_PAGE_Y:
+  case addr_mode::INDIRECT_Y:
+    reads |= resource_y;
+    break;
+  default:
+    break;
+  }
+  if (mode != addr_mode::NONE && mode != addr_mode::IMMEDIATE && mode != addr_mode::CONSTANT) {
+    reads |= resource_memory;
+  }
+
+  const uint16_t sz = resource_s | resource_z;
+  switch (ins.name()) {
+  case instruction_name::NONE:
+    reads = 0;
+    break;
+  case instruction_name::AND:
+  case instruction_name::ORA:
+  case instruction_name::EOR:
+    reads |= resource_a;
+    writes |= resource_a | sz;
+    break;
+  case instruction_name::LDA:
+    writes |= resource_a | sz;
+    break;
+  case instruction_name::LDX:
+    writes |= resource_x | sz;
+    break;
+  case instruction_name::LDY:
+    writes |= resource_y | sz;
+    break;
+  case instruction_name::TXA:
+    reads |= resource_x;
+    writes |= resource_a | sz;
+    break;
+  case instruction_name::TAX:
+    reads |= resource_a;
+    writes |= resource_x | sz;
+    break;
+  case instruction_name::TYA:
+    reads |= resource_y;
+    writes |= resource_a | sz;
+    break;
+  case instruction_name::TAY:
+    reads |= resource_a;
+    writes |= resource_y | sz;
+    break;
+  case instruction_name::INX:
+  case instruction_name::DEX:
+    reads |= resource_x;
+    writes |= resource_x | sz;
+    break;
+  case instruction_name::INY:
+  case instruction_name::DEY:
+    reads |= resource_y;
+    writes |= resource_y | sz;
+    break;
+  case instruction_name::CLC:
+  case instruction_name::SEC:
+    writes |= resource_c;
+    break;
+  case instruction_name::CLI:
+  case instruction_name::SEI:
+    writes |= resource_i;
+    break;
+  case instruction_name::CLV:
+    writes |= resource_v;
+    break;
+  case instruction_name::CLD:
+  case instruction_name::SED:
+    writes |= resource_d;
+    break;
+  case instruction_name::TSX:
+    reads |= resource_sp;
+    writes |= resource_x | sz;
+    break;
+  case instruction_name::TXS:
+    reads |= resource_x;
+    writes |= resource_sp;
+    break;
+  case instruction_name::NOP:
+    break;
+  case instruction_name::INC:
+  case instruction_name::DEC:
+    writes |= resource_memory | sz;
+    break;
+  case instruction_name::BIT:
+    reads |= resource_a;
+    writes |= resource_s | resource_v | resource_z;
+    break;
+  case instruction_name::ASLA:
+  case instruction_name::LSRA:
+    reads |= resource_a;
+    writes |= resource_a | resource_c | sz;
+    break;
+  case instruction_name::ROLA:
+  case instruction_name::RORA:
+    reads |= resource_a | resource_c;
+    writes |= resource_a | resource_c | sz;
+    break;
+  case instruction_name::ASL:
+  case instruction_name::LSR:
+    writes |= resource_memory | resource_c | sz;
+    break;
+  case instruction_name::ROL:
+  case instruction_name::ROR:
+    reads |= resource_c;
+    writes |= resource_memory | resource_c | sz;
+    break;
+  case instruction_name::STA:
+    reads |= resource_a;
+    writes |= resource_memory;
+    break;
+  case instruction_name::STX:
+    reads |= resource_x;
+    writes |= resource_memory;
+    break;
+  case instruction_name::STY:
+    reads |= resource_y;
+    writes |= resource_memory;
+    break;
+  case instruction_name::PLA:
+    reads |= resource_sp | resource_memory;
+    writes |= resource_sp | resource_a | sz;
+    break;
+  case instruction_name::PHA:
+    reads |= resource_sp | resource_a;
+    writes |= resource_sp | resource_memory;
+    break;
+  case instruction_name::PHP:
+    reads |= resource_sp | resource_flags;
+    writes |= resource_sp | resource_memory;
+    break;
+  case instruction_name::PLP:
+    reads |= resource_sp | resource_memory;
+    writes |= resource_sp | resource_flags;
+    break;
+  case instruction_name::ADC:
+  case instruction_name::SBC:
+    reads |= resource_a | resource_c | resource_d;
+    writes |= resource_a | resource_c | resource_v | sz;
+    break;
+  case instruction_name::CMP:
+    reads |= resource_a;
+    writes |= resource_c | sz;
+    break;
+  case instruction_name::CPX:
+    reads |= resource_x;
+    writes |= resource_c | sz;
+    break;
+  case instruction_name::CPY:
+    reads |= resource_y;
+    writes |= resource_c | sz;
+    break;
+  case instruction_name::BPL:
+  case instruction_name::BMI:
+    reads |= resource_s;
+    writes |= resource_exit;
+    break;
+  case instruction_name::BVC:
+  case instruction_name::BVS:
+    reads |= resource_v;
+    writes |= resource_exit;
+    break;
+  case instruction_name::BCC:
+  case instruction_name::BCS:
+    reads |= resource_c;
+    writes |= resource_exit;
+    break;
+  case instruction_name::BEQ:
+  case instruction_name::BNE:
+    reads |= resource_z;
+    writes |= resource_exit;
+    break;
+  default:
+    // Jumps, returns, JSR and BRK leave the sequence, and may use
+    // anything on the way out.
+    reads |= 0xFFFF;
+    writes |= 0xFFFF;
+    break;
+  }
+  return instruction_effects { reads, writes };
+}
+
+// Whether running the two instructions in either order does the same.
+inline bool independent(instruction first, instruction second) {
+  const instruction_effects a = effects(first);
+  const instruction_effects b = effects(second);
+  return !(a.writes & (b.reads | b.writes)) && !(b.writes & a.reads);
+}
+
+/**
+ * Whether adding the instruction to a sequence keeps it in the first
+ * order, by name and addressing mode, of all the orders of its
+ * dependency graph. That's the case unless the new instruction could
+ * move back past an instruction that sorts after it, through
+ * instructions that it's independent of [Anisimov and Knuth's
+ * lexicographic normal form]. Every prefix of a sequence in that order
+ * is in that order too, so it only needs checking as each instruction
+ * is added.
+ *
+ * Two instructions with the same name and mode always depend on each
+ * other, so the order doesn't look at the unknowns, and renaming the
+ * unknowns of a sequence in this order leaves it in this order. That
+ * lets this be used along with canonical_only.
+ */
+inline bool extends_in_dependency_order(const instruction_seq &seq, instruction ins) {
+  const uint16_t key = ins.data >> 4;
+  for (int i = 6; i >= 0; i--) {
+    const instruction before = seq.instructions[i];
+    if (before.name() == instruction_name::NONE) { continue; }
+    if (!independent(before, ins)) { return true; }
+    if ((before.data >> 4) > key) { return false; }
+  }
+  return true;
+}
+
+/**
+ * The resources that the instruction always overwrites, on the
+ * emulator and on a real 6502. Memory is left out, since another
+ * unknown address may not be the same one, and so are the branches'
+ * conditional writes and everything about the ways out.
+ */
+inline uint16_t overwrites(instruction ins) {
+  const instruction_effects e = effects(ins);
+  if (e.writes & resource_exit) { return 0; }
+  uint16_t result = e.writes & ~resource_memory;
+  // The emulator doesn't set S and Z for these.
+  if (ins.name() == instruction_name::TSX || ins.name() == instruction_name::PLA) {
+    result &= ~(resource_s | resource_z);
+  }
+  return result;
+}
+
+/**
+ * True if some instruction of the sequence is dead: everything it
+ * writes is overwritten by the instructions after it before anything
+ * reads it. Leaving it out gives a cheaper sequence that does the
+ * same, so the sequence can't be optimal. An instruction that writes
+ * memory or can leave the sequence is never dead, and the whole state
+ * is read at the end of the sequence and wherever it might leave.
+ */
+inline bool contains_dead_instruction(const instruction_seq &seq) {
+  for (int i = 0; i < 7; i++) {
+    const instruction ins = seq.instructions[i];
+    if (ins.name() == instruction_name::NONE) { break; }
+    const instruction_effects e = effects(ins);
+    if (e.writes & (resource_memory | resource_exit)) { continue; }
+    uint16_t live = e.writes;
+    for (int j = i + 1; j < 7 && live; j++) {
+      const instruction after = seq.instructions[j];
+      if (after.name() == instruction_name::NONE) { break; }
+      const instruction_effects a = effects(after);
+      if ((a.reads & live) || (a.writes & resource_exit)) { break; }
+      live &= ~overwrites(after);
+    }
+    if (!live) { return true; }
+  }
+  return false;
+}
+
+/**
+ * True if the sequence leaves whatever state it starts in: it has a
+ * jump or return, or a branch on a flag whose value is known by then.
+ * Flags are known from the instructions that set or clear them, and
+ * from the branches before that weren't taken.
+ */
+inline bool always_exits(const instruction_seq &seq) {
+  // The flags that are known, and their values.
+  uint16_t known = 0;
+  uint16_t value = 0;
+  for (const instruction ins : seq.instructions) {
+    uint16_t flag = 0;
+    bool taken_when_set = false;
+    switch (ins.name()) {
+    case instruction_name::JMP:
+    case instruction_name::JMPI:
+    case instruction_name::RTS:
+    case instruction_name::RTI:
+      return true;
+    case instruction_name::BPL: flag = resource_s; break;
+    case instruction_name::BMI: flag = resource_s; taken_when_set = true; break;
+    case instruction_name::BVC: flag = resource_v; break;
+    case instruction_name::BVS: flag = resource_v; taken_when_set = true; break;
+    case instruction_name::BCC: flag = resource_c; break;
+    case instruction_name::BCS: flag = resource_c; taken_when_set = true; break;
+    case instruction_name::BNE: flag = resource_z; break;
+    case instruction_name::BEQ: flag = resource_z; taken_when_set = true; break;
+    default:
+      break;
+    }
+    if (flag) {
+      if ((known & flag) && ((value & flag) != 0) == taken_when_set) { return true; }
+      // Only the states that didn't take it go on.
+      known |= flag;
+      value = taken_when_set ? value & ~flag : value | flag;
+      continue;
+    }
+    known &= ~effects(ins).writes;
+    switch (ins.name()) {
+    case instruction_name::CLC: known |= resource_c; value &= ~resource_c; break;
+    case instruction_name::SEC: known |= resource_c; value |= resource_c; break;
+    case instruction_name::CLV: known |= resource_v; value &= ~resource_v; break;
+    default: break;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+#include "stdint.h"
+#include "stdio.h"
+#include "random_machine.h"
+#include "fnv.h"
+
+/**
+ * Initial states built to hit the cases that random states almost
+ * never do: operands that alias each other, addresses that wrap
+ * around a page or the zero page, the values where the sign, carry
+ * and overflow change, and each flag set and clear.
+ *
+ * Two sequences that only differ in those cases get the same
+ * fingerprint from the random machines, and can only be told apart
+ * by z3. `enumerator2 machines <cost>` reports how many buckets each
+ * of these would split.
+ *
+ * None of them write memory, so they can be used to build any of the
+ * machine types. Memory is still the fnv values of the seed, except
+ * that seed 0 gives all 0x00 and 0xFFFFFFFF gives all 0xFF, which
+ * decides where indirect pointers go.
+ */
+typedef struct designed_machine {
+  std::string name;
+  random_machine machine;
+} designed_machine;
+
+std::vector<designed_machine> designed_machines() {
+  std::vector<designed_machine> result;
+  auto add_seeded = [&](const std::string &name, uint32_t seed, std::function<void(random_machine&)> design) {
+    random_machine machine(seed);
+    design(machine);
+    result.push_back(designed_machine { name, machine });
+  };
+  auto add = [&](const std::string &name, std::function<void(random_machine&)> design) {
+    add_seeded(name, fnv_hash(0xD351).add((uint32_t)result.size()).hash32(), design);
+  };
+
+  // Operands that refer to the same memory.
+  add("absolute0 == absolute1", [](random_machine &m) {
+    m.absoluteVars[1] = m.absoluteVars[0];
+  });
+  add("all absolutes equal", [](random_machine &m) {
+    m.absoluteVars[1] = m.absoluteVars[2] = m.absoluteVars[3] = m.absoluteVars[0];
+  });
+  add("zp0 == zp1", [](random_machine &m) {
+    m.zpVars[1] = m.zpVars[0];
+  });
+  add("all zps equal", [](random_machine &m) {
+    m.zpVars[1] = m.zpVars[2] = m.zpVars[3] = m.zpVars[0];
+  });
+  add("absolute0 == zp0", [](random_machine &m) {
+    m.absoluteVars[0] = m.zpVars[0];
+  });
+  add("absolute0 == zp0 + x", [](random_machine &m) {
+    m.absoluteVars[0] = (uint8_t)(m.zpVars[0] + m._x);
+  });
+  add("absolute0 == zp0 + y", [](random_machine &m) {
+    m.absoluteVars[0] = (uint8_t)(m.zpVars[0] + m._y);
+  });
+  add("zp0 == zp1 + x", [](random_machine &m) {
+    m.zpVars[0] = m.zpVars[1] + m._x;
+  });
+  add("absolute0 == absolute1 + x", [](random_machine &m) {
+    m.absoluteVars[0] = m.absoluteVars[1] + m._x;
+  });
+  add("absolute0 == absolute1 + y", [](random_machine &m) {
+    m.absoluteVars[0] = m.absoluteVars[1] + m._y;
+  });
+  add("absolute0 is the top of the stack", [](random_machine &m) {
+    m.absoluteVars[0] = 0x0100 + (uint8_t)(m._sp + 1);
+  });
+  add("absolute0 is the next push", [](random_machine &m) {
+    m.absoluteVars[0] = 0x0100 + m._sp;
+  });
+  add("immediate0 == immediate1", [](random_machine &m) {
+    m.immediateVars[1] = m.immediateVars[0];
+  });
+  add("x == y", [](random_machine &m) {
+    m._y = m._x;
+  });
+  add("a == x == y", [](random_machine &m) {
+    m._x = m._y = m._a;
+  });
+  add("a == immediate0", [](random_machine &m) {
+    m.immediateVars[0] = m._a;
+  });
+  add("a == memory at zp0", [](random_machine &m) {
+    m._a = m.read(m.zpVars[0]);
+  });
+  add("x == memory at absolute0", [](random_machine &m) {
+    m._x = m.read(m.absoluteVars[0]);
+  });
+
+  // Addresses that wrap.
+  add("zp0 == 0xFF", [](random_machine &m) {
+    m.zpVars[0] = 0xFF;
+  });
+  add("zp0 + x wraps the zero page", [](random_machine &m) {
+    m.zpVars[0] = 0xF0;
+    m._x = 0x20;
+  });
+  add("absolute0 + x crosses a page", [](random_machine &m) {
+    m.absoluteVars[0] = (m.absoluteVars[0] & 0xFF00) | 0xF0;
+    m._x = 0x20;
+  });
+  add("absolute0 + y wraps 0xFFFF", [](random_machine &m) {
+    m.absoluteVars[0] = 0xFFF0;
+    m._y = 0x20;
+  });
+  add("sp == 0x00", [](random_machine &m) {
+    m._sp = 0x00;
+  });
+  add("sp == 0xFF", [](random_machine &m) {
+    m._sp = 0xFF;
+  });
+  add_seeded("zero memory, zp0 == 0xFF", 0, [](random_machine &m) {
+    m.zpVars[0] = 0xFF;
+  });
+  add_seeded("0xFF memory, zp0 == 0xFF", 0xFFFFFFFF, [](random_machine &m) {
+    m.zpVars[0] = 0xFF;
+  });
+
+  // The values on either side of the sign and carry boundaries, in
+  // every register and operand.
+  for (uint8_t value : { 0x00, 0x01, 0x7F, 0x80, 0xFF }) {
+    char name[32];
+    snprintf(name, sizeof(name), "everything 0x%02X", value);
+    add(name, [=](random_machine &m) {
+      m._a = m._x = m._y = value;
+      for (int i = 0; i < 4; i++) {
+        m.immediateVars[i] = value;
+        m.zpVars[i] = value;
+      }
+    });
+  }
+
+  // Each flag set and clear, and the cases where the carry and
+  // overflow of an add or subtract flip.
+  auto flags = [](random_machine &m, bool value) {
+    m._ccS = m._ccV = m._ccI = m._ccD = m._ccC = m._ccZ = value;
+  };
+  add("all flags set", [=](random_machine &m) { flags(m, true); });
+  add("all flags clear", [=](random_machine &m) { flags(m, false); });
+  add("a + immediate0 carries", [=](random_machine &m) {
+    flags(m, false);
+    m._a = 0xFF;
+    m.immediateVars[0] = 0x01;
+  });
+  add("a + immediate0 + carry carries", [=](random_machine &m) {
+    flags(m, false);
+    m._ccC = true;
+    m._a = 0x80;
+    m.immediateVars[0] = 0x7F;
+  });
+  add("a + immediate0 overflows", [=](random_machine &m) {
+    flags(m, false);
+    m._a = 0x7F;
+    m.immediateVars[0] = 0x01;
+  });
+  add("a - immediate0 overflows", [=](random_machine &m) {
+    flags(m, true);
+    m._a = 0x80;
+    m.immediateVars[0] = 0x01;
+  });
+  add("a - immediate0 borrows", [=](random_machine &m) {
+    flags(m, true);
+    m._a = 0x00;
+    m.immediateVars[0] = 0x01;
+  });
+  return result;
+}
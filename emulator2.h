@@ -1,59 +1,96 @@
 #pragma once
+#include <utility>
 #include "instructions2.h"
 
 template<typename machine>
 struct emulator {
-  void instruction(machine &m, const instruction ins) const {
-    if (ins.name() == instruction_name::NONE) {
+  // Runs one instruction on the machine. Each kernel is a copy of
+  // execute() for one name and addressing mode, so it doesn't have to
+  // switch on them at run time; only the operand number is passed in.
+  typedef void (*kernel)(machine &m, const uint8_t number);
+
+  void instruction(machine &m, const ::instruction ins) const {
+    kernel_for(ins)(m, ins.number());
+  }
+
+  static kernel kernel_for(const ::instruction ins) {
+    return kernels.entries[ins.data >> 4];
+  }
+
+  // The kernels, indexed by the name and mode bits of an instruction.
+  // Instructions missing from the instructions table do nothing.
+  static constexpr int num_kernels = ((int)instruction_name::RORA + 1) << 4;
+  typedef struct kernel_table {
+    kernel entries[num_kernels];
+  } kernel_table;
+  static const kernel_table kernels;
+
+  template<size_t... I>
+  static constexpr kernel_table make_kernels(std::index_sequence<I...>) {
+    constexpr kernel list[] = { &execute<instructions[I].ins.name(), instructions[I].ins.mode()>... };
+    constexpr uint16_t index[] = { (uint16_t)(instructions[I].ins.data >> 4)... };
+    kernel_table table = {};
+    for (int i = 0; i < num_kernels; i++) {
+      table.entries[i] = &execute<instruction_name::NONE, addr_mode::NONE>;
+    }
+    for (size_t i = 0; i < sizeof...(I); i++) {
+      table.entries[index[i]] = list[i];
+    }
+    return table;
+  }
+
+  template<instruction_name name, addr_mode mode>
+  static void execute(machine &m, const uint8_t number) {
+    if (name == instruction_name::NONE) {
       return;
     }
 
     auto absoluteVar = m.absolute(0);
     auto immediateVar = m.immediate(0);
 
-    switch(ins.mode()) {
+    switch(mode) {
     case addr_mode::NONE:
       break; // nothing to do
     case addr_mode::ABSOLUTE:
-      absoluteVar = m.absolute(ins.number());
+      absoluteVar = m.absolute(number);
       break;
     case addr_mode::ABSOLUTE_X:
-      absoluteVar = m.absolute(ins.number()) + m.extend(m._x);
+      absoluteVar = m.absolute(number) + m.extend(m._x);
       break;
     case addr_mode::ABSOLUTE_Y:
-      absoluteVar = m.absolute(ins.number()) + m.extend(m._y);
+      absoluteVar = m.absolute(number) + m.extend(m._y);
       break;
     case addr_mode::X_INDIRECT:
-      absoluteVar = m.extend(m.read(m.extend(((m.zp(ins.number()) + m._x) & 0xFF))))
-        | (m.extend(m.read(m.extend((m.zp(ins.number()) + m._x + 1) & 0xFF))) << 8);
+      absoluteVar = m.extend(m.read(m.extend(((m.zp(number) + m._x) & 0xFF))))
+        | (m.extend(m.read(m.extend((m.zp(number) + m._x + 1) & 0xFF))) << 8);
       absoluteVar = (m.extend(m.read(absoluteVar+1)) << 8) | m.extend(m.read(absoluteVar));
       break;
     case addr_mode::INDIRECT_Y:
-      absoluteVar = (m.extend(m.read(m.extend(m.zp(ins.number()))))
-        | (m.extend(m.read(m.extend((m.zp(ins.number()) + 1) & 0xFF))) << 8)) + m.extend(m._y);
+      absoluteVar = (m.extend(m.read(m.extend(m.zp(number))))
+        | (m.extend(m.read(m.extend((m.zp(number) + 1) & 0xFF))) << 8)) + m.extend(m._y);
       break;
     case addr_mode::ZERO_PAGE:
-      absoluteVar = m.extend(m.zp(ins.number()));
+      absoluteVar = m.extend(m.zp(number));
       break;
     case addr_mode::ZERO_PAGE_X:
-      absoluteVar = m.extend(m.zp(ins.number()) + m._x);
+      absoluteVar = m.extend(m.zp(number) + m._x);
       break;
     case addr_mode::ZERO_PAGE_Y:
-      absoluteVar = m.extend(m.zp(ins.number()) + m._y);
+      absoluteVar = m.extend(m.zp(number) + m._y);
       break;
     case addr_mode::IMMEDIATE:
-      immediateVar = m.immediate(ins.number());
+      immediateVar = m.immediate(number);
       break;
     case addr_mode::CONSTANT:
-      immediateVar = m.constant(addr_mode_constant_values[ins.number()]);
+      immediateVar = m.constant(addr_mode_constant_values[number]);
     }
 
     // If we aren't using the immediate operand, then read the address we found.
-    if (ins.mode() != addr_mode::IMMEDIATE && ins.mode() != addr_mode::CONSTANT) {
+    if (mode != addr_mode::IMMEDIATE && mode != addr_mode::CONSTANT) {
       immediateVar = m.read(absoluteVar);
     }
 
-    switch (ins.name()) {
+    switch (name) {
     case instruction_name::NONE:
       break; // nothing to do
     case instruction_name::AND:
@@ -148,13 +185,13 @@ struct emulator {
       m.write(absoluteVar, m.setSZ(m.shl(immediateVar)));
       break;
     case instruction_name::ROLA: {
-      auto val = m.shl(m._a) | m.ite(m._ccC, m.constant(1), m.constant(0));
+      auto val = m.shl(m._a) | m.ite(m.ccC(), m.constant(1), m.constant(0));
       m.ccC((m._a & 0x80) == 0x80);
       m.a(m.setSZ(val));
       break;
       }
     case instruction_name::ROL: {
-      auto val = m.shl(immediateVar) | m.ite(m._ccC, m.constant(1), m.constant(0));
+      auto val = m.shl(immediateVar) | m.ite(m.ccC(), m.constant(1), m.constant(0));
       m.ccC((immediateVar & 0x80) == 0x80);
       m.write(absoluteVar, m.setSZ(val));
       break;
@@ -168,13 +205,13 @@ struct emulator {
       m.write(absoluteVar, m.setSZ(m.shr(immediateVar)));
       break;
     case instruction_name::RORA: {
-      auto val = m.shr(m._a) | m.ite(m._ccC, 0x80, 0x00);
+      auto val = m.shr(m._a) | m.ite(m.ccC(), 0x80, 0x00);
       m.ccC((m._a & 0x01) == 0x01);
       m.a(m.setSZ(val));
       break;
       }
     case instruction_name::ROR: {
-      auto val = m.shr(immediateVar) | m.ite(m._ccC, 0x80, 0x00);
+      auto val = m.shr(immediateVar) | m.ite(m.ccC(), 0x80, 0x00);
       m.ccC((immediateVar & 0x01) == 0x01);
       m.write(absoluteVar, m.setSZ(val));
       break;
@@ -197,12 +234,12 @@ struct emulator {
       m.sp(m._sp - 1);
       break;
     case instruction_name::PHP: {
-      auto p = m.ite(m._ccS, 0x80, 0x00)
-             | m.ite(m._ccV, 0x40, 0x00)
-             | m.ite(m._ccD, 0x08, 0x00)
-             | m.ite(m._ccI, 0x04, 0x00)
-             | m.ite(m._ccZ, 0x02, 0x00)
-             | m.ite(m._ccC, 0x01, 0x00);
+      auto p = m.ite(m.ccS(), 0x80, 0x00)
+             | m.ite(m.ccV(), 0x40, 0x00)
+             | m.ite(m.ccD(), 0x08, 0x00)
+             | m.ite(m.ccI(), 0x04, 0x00)
+             | m.ite(m.ccZ(), 0x02, 0x00)
+             | m.ite(m.ccC(), 0x01, 0x00);
       m.write(m.extend(m._sp) + 0x0100, p);
       m.sp(m._sp - 1);
       break;
@@ -222,26 +259,23 @@ struct emulator {
       immediateVar = immediateVar ^ 0xFF;
       /* fallthrough */
     case instruction_name::ADC: {
-      auto sum = m.extend(immediateVar) + m.extend(m._a) + m.extend(m.ite(m._ccC, 0x01, 0x00));
-      m.ccV(0x80 == (0x80 & (m.lobyte(sum) ^ m._a) & (m.lobyte(sum) ^ immediateVar)));
+      auto sum = m.extend(immediateVar) + m.extend(m._a) + m.extend(m.ite(m.ccC(), 0x01, 0x00));
+      m.setV(m._a, immediateVar, m.lobyte(sum));
       m.ccC(m.hibyte(sum) == 0x01);
       m.a(m.setSZ(m.lobyte(sum)));
       break;
       }
     case instruction_name::CMP:
       m.ccC(m.uge(m._a, immediateVar));
-      m.ccS(m.uge(m._a - immediateVar, 0x80));
-      m.ccZ(m._a == immediateVar);
+      m.setSZ(m._a - immediateVar);
       break;
     case instruction_name::CPX:
       m.ccC(m.uge(m._x, immediateVar));
-      m.ccS(m.uge(m._x - immediateVar, 0x80));
-      m.ccZ(m._x == immediateVar);
+      m.setSZ(m._x - immediateVar);
       break;
     case instruction_name::CPY:
       m.ccC(m.uge(m._y, immediateVar));
-      m.ccS(m.uge(m._y - immediateVar, 0x80));
-      m.ccZ(m._y == immediateVar);
+      m.setSZ(m._y - immediateVar);
       break;
     case instruction_name::JMP:
       m.jmp(absoluteVar);
@@ -258,28 +292,28 @@ struct emulator {
       m.rts();
       break;
     case instruction_name::BPL:
-      m.branch(!m._ccS, absoluteVar);
+      m.branch(!m.ccS(), absoluteVar);
       break;
     case instruction_name::BMI:
-      m.branch(m._ccS, absoluteVar);
+      m.branch(m.ccS(), absoluteVar);
       break;
     case instruction_name::BVS:
-      m.branch(m._ccV, absoluteVar);
+      m.branch(m.ccV(), absoluteVar);
       break;
     case instruction_name::BVC:
-      m.branch(!m._ccV, absoluteVar);
+      m.branch(!m.ccV(), absoluteVar);
       break;
     case instruction_name::BCC:
-      m.branch(!m._ccC, absoluteVar);
+      m.branch(!m.ccC(), absoluteVar);
       break;
     case instruction_name::BCS:
-      m.branch(m._ccC, absoluteVar);
+      m.branch(m.ccC(), absoluteVar);
       break;
     case instruction_name::BEQ:
-      m.branch(m._ccZ, absoluteVar);
+      m.branch(m.ccZ(), absoluteVar);
       break;
     case instruction_name::BNE:
-      m.branch(!m._ccZ, absoluteVar);
+      m.branch(!m.ccZ(), absoluteVar);
       break;
     case instruction_name::JSR:
     case instruction_name::BRK:
@@ -288,3 +322,35 @@ struct emulator {
     }
   }
 };
+
+template<typename machine>
+constexpr typename emulator<machine>::kernel_table emulator<machine>::kernels =
+  emulator<machine>::make_kernels(std::make_index_sequence<sizeof(instructions) / sizeof(instructions[0])>());
+
+/**
+ * An instruction sequence decoded once for one machine type: the
+ * kernel and operand number of each instruction, without the empty
+ * slots. Running it is a series of direct calls, so a sequence that
+ * runs on several machines or batches of machines is only decoded once.
+ */
+template<typename machine>
+struct compiled_sequence {
+  typename emulator<machine>::kernel kernels[7];
+  uint8_t numbers[7];
+  uint8_t length = 0;
+
+  compiled_sequence(const instruction_seq &seq) {
+    for (auto ins : seq.instructions) {
+      if (ins.name() == instruction_name::NONE) { continue; }
+      kernels[length] = emulator<machine>::kernel_for(ins);
+      numbers[length] = ins.number();
+      length++;
+    }
+  }
+
+  void run(machine &m) const {
+    for (int i = 0; i < length; i++) {
+      kernels[i](m, numbers[i]);
+    }
+  }
+};
@@ -1,22 +1,174 @@
+#include <algorithm>
+#include <chrono>
 #include <fstream>
 #include <vector>
 #include <array>
 #include <string>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
 #include "stdint.h"
+#include "stdio.h"
 #include "inttypes.h"
 #include "instructions2.h"
 #include "emulator2.h"
 #include "random_machine.h"
+#include "random_machine_x16.h"
+#include "bitsliced_machine.h"
 #include "z3++.h"
 #include "abstract_machine.h"
+#include "counterexamples.h"
+#include "canonical.h"
+#include "dependencies.h"
+#include "designed_machines.h"
+#include "non_optimal.h"
+#include "initial_memory.h"
+#include "mapped_file.h"
 #include "fnv.h"
+#include "state_hash.h"
 #include "radix-sort.h"
+#include "queue.h"
 #include <gperftools/profiler.h>
 
 constexpr int max_cost = 140;
 
-z3::check_result canBeDifferent(z3::solver &s, const abstract_machine &ma, const abstract_machine &mb) {
+// Sequences with more bytes than this aren't written, so a search for
+// code that has to fit in a few bytes doesn't enumerate everything
+// else of the same cycles. Bytes only go up as a sequence is extended.
+constexpr int max_bytes = 7 * 3;
+
+// The number of initial machines each sequence is fingerprinted on.
+// 16 runs them as vector lanes, 64 uses the bitsliced machine.
+constexpr int fingerprint_machines = 16;
+static_assert(fingerprint_machines == 16 || fingerprint_machines == 64, "Fingerprints use 16 or 64 machines");
+
+// The kernel from state_hash.h that hashes the state of each of the 16
+// machines and then combines them. The bitsliced machine hashes its
+// bit planes directly and doesn't use it. `hashes <cost>` compares them.
+typedef mix_kernel fingerprint_kernel;
+
+// Work out the initial memory of the 16 fingerprint machines for every
+// address up front (1MiB), so that reading memory that hasn't been
+// written is a load instead of a hash. The tables can be put on huge
+// pages so that they don't use up the TLB.
+constexpr bool precomputed_memory = true;
+constexpr bool precomputed_memory_huge_pages = true;
+
+// Only enumerate canonical sequences, where the unknowns of each kind
+// are numbered in the order they're first used. The other renamings
+// do the same thing to different unknowns, so they're left out of the
+// result files, and when a layer is compared with the cheaper ones,
+// their fingerprints are worked out from the canonical sequence.
+// Anything else that reads the result files by fingerprint has to do
+// the same, as a bucket only holds the canonical names.
+constexpr bool canonical_only = true;
+
+// Only enumerate one order of the instructions that don't depend on
+// each other: the first by name and addressing mode, as worked out by
+// dependencies.h. `clc; ldx #0` is enumerated, but `ldx #0; clc`
+// isn't. Every order does exactly the same thing, so for long runs of
+// independent instructions this leaves out all but one of their
+// permutations.
+constexpr bool dependency_order_only = false;
+
+// The number of sequences of a layer that one task extends by one
+// instruction. The tasks are shared out between all of the cores.
+constexpr size_t extension_chunk_size = 4096;
+
+// The number of sequences of a layer that are read in and extended at
+// a time, so that the memory used doesn't grow with the layer. Layers
+// up to this size are extended in one go. Bigger layers are written a
+// block at a time, in a different order than one go would write them,
+// so nothing that reads a sorted layer depends on the order of the
+// sequences in a bucket.
+constexpr size_t extension_block_size = extension_chunk_size * 1024;
+static_assert(extension_block_size % extension_chunk_size == 0, "Blocks are made of whole chunks");
+
+// Save the state of the fingerprint machines after each sequence in
+// out/state-<cost>.dat, next to the result file. Extending a sequence
+// then only runs the new instruction instead of the whole sequence.
+constexpr bool store_states = false;
+static_assert(!store_states || fingerprint_machines == 16, "States are only stored for 16 machines");
+
+// After sorting a layer, keep only the cheapest sequence of each
+// bucket as the sequences to extend, and move the rest to
+// out/equivalents-<cost>.dat. Anything built on a sequence that isn't
+// the cheapest can't be the cheapest either.
+constexpr bool representatives_only = false;
+static_assert(!representatives_only || !store_states, "The state file has to line up with every sequence in the layer");
+
+// Before extending a layer, use z3 to prove which of its sequences
+// behave the same as something cheaper, and add them to
+// out/non-optimal.dat. Sequences that contain any of those runs aren't
+// written to the later layers, since layers are processed in order of
+// cost and the cheaper version is always found first.
+constexpr bool prune_non_optimal = false;
+static_assert(!prune_non_optimal || !store_states, "Proving needs the layer to be sorted before it's extended");
+
+// Don't write sequences with a dead instruction, one whose every write
+// is overwritten before it's read, like the lda in `lda zp0; lda #C0`.
+// Leaving it out is cheaper and does the same thing.
+constexpr bool prune_dead_instructions = false;
+
+// A sequence is beaten by one that behaves the same and is no worse in
+// cycles or bytes and better in one of them, instead of by anything
+// with fewer cycles. Then the fastest and the smallest sequence, and
+// every trade-off between them, are kept as representatives and aren't
+// proven non-optimal, for finding rules that save space as well as time.
+constexpr bool pareto_optimal = false;
+
+// The number of bits in the fingerprint that result files are sorted
+// and grouped by. 128 makes it unlikely that unrelated sequences share
+// a bucket on very large layers, at the cost of 8 more bytes a record.
+constexpr int fingerprint_bits = 64;
+static_assert(fingerprint_bits == 64 || fingerprint_bits == 128, "Fingerprints are 64 or 128 bits");
+
+// Store a hash of each part of the state that can be dead after a
+// sequence next to the fingerprint, so that a result file can be
+// regrouped for any set of live registers and flags with `rekey`.
+constexpr bool component_hashes = false;
+static_assert(!component_hashes || fingerprint_machines == 16, "Component hashes are only stored for 16 machines");
+
+// The parts of the state that may be dead after a sequence, as bits
+// of a liveness mask. Everything else is always live.
+enum live_component : uint16_t {
+  live_a = 0x001,
+  live_x = 0x002,
+  live_y = 0x004,
+  live_ccS = 0x008,
+  live_ccV = 0x010,
+  live_ccI = 0x020,
+  live_ccD = 0x040,
+  live_ccC = 0x080,
+  live_ccZ = 0x100,
+  live_all = 0x1FF,
+};
+
+// Parses a liveness mask written as the live components, like "axyC"
+// for the registers and carry. Returns -1 for an unknown component.
+int parse_live_mask(const std::string &components) {
+  const std::string names = "axySVIDCZ";
+  int mask = 0;
+  for (char c : components) {
+    auto i = names.find(c);
+    if (i == std::string::npos) { return -1; }
+    mask |= 1 << i;
+  }
+  return mask;
+}
+
+// Initial states found by the solver that tell sequences apart.
+constexpr const char *counterexample_file = "out/counterexamples.dat";
+
+// Runs of instructions that have been proven non-optimal.
+constexpr const char *non_optimal_file = "out/non-optimal.dat";
+
+// If the machines can be different and model is given, it is set to
+// a starting state that shows it.
+z3::check_result canBeDifferent(z3::solver &s, const abstract_machine &ma, const abstract_machine &mb, z3::model *model = nullptr) {
   s.push();
   s.add(!(
     ma._earlyExit == mb._earlyExit &&
@@ -34,38 +186,121 @@ z3::check_result canBeDifferent(z3::solver &s, const abstract_machine &ma, const
   ));
   
   auto result = s.check();
+  if (result == z3::sat && model) {
+    *model = s.get_model();
+  }
   s.pop();
   return result;
 }
 
+/**
+ * Checks whether two sequences with the same fingerprint can end
+ * up different. Pairs that a learned counterexample already tells
+ * apart skip the solver, and every sat model the solver returns is
+ * learned for the pairs after it.
+ */
+z3::check_result canBeDifferent(z3::solver &s, counterexample_set &learned, const instruction_seq &a, const instruction_seq &b) {
+  const compiled_sequence<random_machine> ca(a);
+  const compiled_sequence<random_machine> cb(b);
+  if (learned.distinguishes(ca, cb)) {
+    return z3::sat;
+  }
+  abstract_machine ma(s.ctx());
+  abstract_machine mb(s.ctx());
+  compiled_sequence<abstract_machine>(a).run(ma);
+  compiled_sequence<abstract_machine>(b).run(mb);
+  z3::model model(s.ctx());
+  auto result = canBeDifferent(s, ma, mb, &model);
+  if (result == z3::sat) {
+    learned.learn(model, ca, cb);
+  }
+  return result;
+}
+
 typedef struct execution_hash {
-  typedef std::array<uint8_t, 8> buffer_t;
+  static const int key_size = fingerprint_bits / 8;
+  static const int size = key_size + (component_hashes ? 32 : 0);
+  typedef std::array<uint8_t, size> buffer_t;
 
+  // The hash the file is sorted and grouped by, and its upper half
+  // with 128 bit fingerprints.
   uint64_t alwaysIncluded;
+  uint64_t alwaysIncludedHigh = 0;
+
+  // With component_hashes, the parts the fingerprint is made from.
+  // Registers are hashed over the machines; the flags are stored
+  // exactly, one bit per machine.
+  uint64_t alwaysLive;
+  uint32_t a, x, y;
+  uint16_t flags[6]; // S, V, I, D, C, Z
+
+  // Combines the components that are live in the mask into a hash
+  // to group by.
+  void rekey(uint16_t live) {
+    alwaysIncluded = key(live, 0);
+    alwaysIncludedHigh = fingerprint_bits == 128 ? key(live, 0x80000000) : 0;
+  }
+
+  uint64_t key(uint16_t live, uint32_t seed) const {
+    fnv_hash result(seed | live);
+    result.add(alwaysLive);
+    const uint32_t registers[3] = { a, x, y };
+    for (int i = 0; i < 3; i++) {
+      if (live & (live_a << i)) { result.add(registers[i]); }
+    }
+    for (int i = 0; i < 6; i++) {
+      if (live & (live_ccS << i)) { result.add(flags[i]); }
+    }
+    return result.hash64();
+  }
 
   buffer_t as_buffer() const {
     buffer_t result = {0};
-    result[0] = alwaysIncluded;
-    result[1] = alwaysIncluded >> 8;
-    result[2] = alwaysIncluded >> 16;
-    result[3] = alwaysIncluded >> 24;
-    result[4] = alwaysIncluded >> 32;
-    result[5] = alwaysIncluded >> 40;
-    result[6] = alwaysIncluded >> 48;
-    result[7] = alwaysIncluded >> 56;
+    uint8_t *p = result.data();
+    auto put = [&](uint64_t value, int bytes) {
+      for (int i = 0; i < bytes; i++) {
+        *p++ = value >> (8 * i);
+      }
+    };
+    put(alwaysIncluded, 8);
+    if (fingerprint_bits == 128) {
+      put(alwaysIncludedHigh, 8);
+    }
+    if (component_hashes) {
+      put(alwaysLive, 8);
+      put(a, 4);
+      put(x, 4);
+      put(y, 4);
+      for (int i = 0; i < 6; i++) {
+        put(flags[i], 2);
+      }
+    }
     return result;
   }
 
   static execution_hash from_buffer(buffer_t buffer) {
     execution_hash result;
-    result.alwaysIncluded = buffer[0]
-      | (((uint64_t)buffer[1]) << 8)
-      | (((uint64_t)buffer[2]) << 16)
-      | (((uint64_t)buffer[3]) << 24)
-      | (((uint64_t)buffer[4]) << 32)
-      | (((uint64_t)buffer[5]) << 40)
-      | (((uint64_t)buffer[6]) << 48)
-      | (((uint64_t)buffer[7]) << 56);
+    const uint8_t *p = buffer.data();
+    auto get = [&](int bytes) {
+      uint64_t value = 0;
+      for (int i = 0; i < bytes; i++) {
+        value |= ((uint64_t)*p++) << (8 * i);
+      }
+      return value;
+    };
+    result.alwaysIncluded = get(8);
+    if (fingerprint_bits == 128) {
+      result.alwaysIncludedHigh = get(8);
+    }
+    if (component_hashes) {
+      result.alwaysLive = get(8);
+      result.a = get(4);
+      result.x = get(4);
+      result.y = get(4);
+      for (int i = 0; i < 6; i++) {
+        result.flags[i] = get(2);
+      }
+    }
     return result;
   }
 } execution_hash;
@@ -92,50 +327,205 @@ static const random_machine initial_machines[16] {
   random_machine(0x34E90C6C),
 };
 
-execution_hash hash(instruction_seq seq) {
-  random_machine rms[16];
-  memcpy(rms, initial_machines, sizeof(rms));
-  emulator<random_machine> emu;
-  for (auto instruction : seq.instructions) {
-    for (auto &rm : rms) {
-      emu.instruction(rm, instruction);
+static const initial_memory_tables initial_memory(initial_machines, precomputed_memory ? 16 : 0, precomputed_memory_huge_pages);
+
+static const random_machine_x16 initial_machines_x16 = []() {
+  random_machine machines[16];
+  for (int i = 0; i < 16; i++) {
+    machines[i] = initial_machines[i];
+    if (precomputed_memory) {
+      machines[i].initialMemory = initial_memory.table(i);
     }
   }
+  return random_machine_x16(machines);
+}();
+
+// The 16 machines above, followed by 48 more seeded from their index.
+static const bitsliced_machine initial_machines_x64 = []() {
+  random_machine machines[bitsliced_machine::lanes];
+  for (int i = 0; i < bitsliced_machine::lanes; i++) {
+    machines[i] = i < 16 ? initial_machines[i] : random_machine(fnv_hash(0x6502).add((uint32_t)i).hash32());
+  }
+  return bitsliced_machine(machines);
+}();
+
+execution_hash hash_x64(instruction_seq seq) {
+  bitsliced_machine machine = initial_machines_x64;
+  compiled_sequence<bitsliced_machine>(seq).run(machine);
+
+  execution_hash result;
+  result.alwaysIncluded = machine.hash();
+  if (fingerprint_bits == 128) {
+    result.alwaysIncludedHigh = machine.hash(0x6502650265026502u);
+  }
+  return result;
+}
+
+// Runs the sequence on each of the 16 initial machines.
+random_machine_x16 run(instruction_seq seq) {
+  random_machine_x16 rms = initial_machines_x16;
+  compiled_sequence<random_machine_x16>(seq).run(rms);
+  return rms;
+}
+
+// Hashes the fingerprints of the 16 machines into one, in lane order
+// or reversed.
+template<typename kernel>
+uint64_t combine_lanes(const u64x16 &lanes, uint64_t seed, bool reversed) {
+  uint64_t hash = kernel::template start<uint64_t>(seed);
+  for (int i = 0; i < random_machine_x16::lanes; i++) {
+    hash = kernel::add(hash, (uint64_t)lanes[reversed ? random_machine_x16::lanes - 1 - i : i]);
+  }
+  return kernel::finish(hash);
+}
 
+execution_hash hash(const random_machine_x16 &rms) {
   const uint32_t seed = 0x18480949;
-  fnv_hash hash_all(seed);
-  for (auto &rm : rms) {
-    hash_all.add(rm.hash());
+  const u64x16 fingerprints = rms.fingerprint<fingerprint_kernel>();
+
+  execution_hash result;
+  result.alwaysIncluded = combine_lanes<fingerprint_kernel>(fingerprints, seed, false);
+  if (fingerprint_bits == 128) {
+    // The lanes in the other order, so that the halves don't collide
+    // together.
+    result.alwaysIncludedHigh = combine_lanes<fingerprint_kernel>(fingerprints, ~seed, true);
   }
-  
-  return execution_hash {
-    .alwaysIncluded = hash_all.hash64(),
-  };
+  if (component_hashes) {
+    fnv_hash always_live(seed);
+    const u32x16 always_live_hashes = rms.hash_always_live();
+    for (int i = 0; i < random_machine_x16::lanes; i++) {
+      always_live.add((uint32_t)always_live_hashes[i]);
+    }
+    result.alwaysLive = always_live.hash64();
+    uint32_t *registers[3] = { &result.a, &result.x, &result.y };
+    const u8x16 *values[3] = { &rms._a, &rms._x, &rms._y };
+    for (int r = 0; r < 3; r++) {
+      fnv_hash h(seed);
+      for (int i = 0; i < random_machine_x16::lanes; i++) {
+        h.add((uint8_t)(*values[r])[i]);
+      }
+      *registers[r] = h.hash32();
+    }
+    const b8x16 *flags[6] = { &rms._ccS, &rms._ccV, &rms._ccI, &rms._ccD, &rms._ccC, &rms._ccZ };
+    for (int i = 0; i < 6; i++) {
+      result.flags[i] = movemask(*flags[i]);
+    }
+  }
+  return result;
+}
+
+execution_hash hash(instruction_seq seq) {
+  if (fingerprint_machines == 64) {
+    return hash_x64(seq);
+  }
+  return hash(run(seq));
+}
+
+// The machines for the second tier of fingerprints: 128 more machines,
+// with the seeds enumerator.cpp splits buckets with.
+static const std::array<bitsliced_machine, 2> refining_machines = []() {
+  std::array<bitsliced_machine, 2> result;
+  for (int batch = 0; batch < 2; batch++) {
+    random_machine machines[bitsliced_machine::lanes];
+    for (int i = 0; i < bitsliced_machine::lanes; i++) {
+      machines[i] = random_machine(0x56346d56 + (batch * bitsliced_machine::lanes + i) * 1001);
+    }
+    result[batch] = bitsliced_machine(machines);
+  }
+  return result;
+}();
+
+/**
+ * A stronger fingerprint than hash(), which also runs the sequence on
+ * the refining machines. It's only worth computing for sequences that
+ * share a bucket, since the rest are already known to be unique.
+ */
+execution_hash refined_hash(const execution_hash &hash, const instruction_seq &seq) {
+  fnv_hash low(0x2b992ddf);
+  fnv_hash high(0x6502);
+  low.add(hash.alwaysIncluded);
+  high.add(hash.alwaysIncludedHigh);
+  const compiled_sequence<bitsliced_machine> compiled(seq);
+  for (const auto &initial : refining_machines) {
+    bitsliced_machine machine = initial;
+    compiled.run(machine);
+    low.add(machine.hash());
+    if (fingerprint_bits == 128) {
+      high.add(machine.hash(0x6502650265026502u));
+    }
+  }
+
+  execution_hash result = hash;
+  result.alwaysIncluded = low.hash64();
+  if (fingerprint_bits == 128) {
+    result.alwaysIncludedHigh = high.hash64();
+  }
+  return result;
+}
+
+/**
+ * True if the sequence has exited whatever state it started in, by a
+ * jump or return or a branch that is always taken. Anything after it
+ * never runs, so extending it only repeats its fingerprint. A branch
+ * that's taken on every fingerprint machine may still not be taken on
+ * some other state, so this is worked out from the instructions.
+ */
+bool has_exited(const instruction_seq &seq) {
+  return always_exits(seq);
 }
 
 typedef struct hash_output_file {
-  static const int hash_size_used = 8;
-  static const int hash_size = 8;
+  static const int hash_size_used = execution_hash::key_size;
+  static const int hash_size = execution_hash::size;
   static const int instructions_size = 14;
-  static const int total_size = 22;
+  static const int total_size = hash_size + instructions_size;
   std::ofstream file;
+  std::ofstream states;
 
-  hash_output_file(uint8_t cost, bool trunc) : file("out/result-" + std::to_string(cost) + ".dat", std::ofstream::binary | std::ofstream::out | (trunc ? std::ofstream::trunc : std::ofstream::app)) {}
+  hash_output_file(uint8_t cost, bool trunc) : file("out/result-" + std::to_string(cost) + ".dat", std::ofstream::binary | std::ofstream::out | (trunc ? std::ofstream::trunc : std::ofstream::app)) {
+    if (store_states) {
+      states.open(state_file_name(cost), std::ofstream::binary | std::ofstream::out | (trunc ? std::ofstream::trunc : std::ofstream::app));
+    }
+  }
+
+  static std::string state_file_name(uint8_t cost) {
+    return "out/state-" + std::to_string(cost) + ".dat";
+  }
+
+  // Fingerprints and writes the sequence, along with its state
+  // when states are stored.
+  void write(const instruction_seq &seq) {
+    if (store_states) {
+      auto state = run(seq);
+      write(hash(state), seq, state);
+    } else {
+      write(hash(seq), seq);
+    }
+  }
+
+  void write(const execution_hash &hash, const instruction_seq &seq, const random_machine_x16 &state) {
+    write(hash, seq);
+    state.save(states);
+  }
 
   void write(const execution_hash &hash, const instruction_seq &seq) {
-    write_hash(hash);
-    write_instructions(seq);
+    write_record(file, hash, seq);
+  }
+
+  static void write_record(std::ostream &out, const execution_hash &hash, const instruction_seq &seq) {
+    write_hash(out, hash);
+    write_instructions(out, seq);
   }
 
-  void write_hash(const execution_hash &hash) {
+  static void write_hash(std::ostream &out, const execution_hash &hash) {
     auto data = hash.as_buffer();
-    file.write((char*)data.data(), data.size());
+    out.write((char*)data.data(), data.size());
   }
 
-  void write_instructions(const instruction_seq &seq) {
+  static void write_instructions(std::ostream &out, const instruction_seq &seq) {
     for (auto &instruction : seq.instructions) {
-      file.put(instruction.data);
-      file.put(instruction.data >> 8);
+      out.put(instruction.data);
+      out.put(instruction.data >> 8);
     }
   }
 } hash_output_file;
@@ -177,6 +567,44 @@ typedef struct hash_input_file {
   }
 } hash_input_file;
 
+// Reads the instructions written by write_instructions().
+instruction_seq decode_instructions(const uint8_t *buffer) {
+  instruction_seq seq;
+  for (int i = 0; i < hash_output_file::instructions_size; i += 2) {
+    instruction ins;
+    ins.data = buffer[i] | (buffer[i + 1] << 8);
+    if (ins.name() == instruction_name::NONE) { break; }
+    for (auto info : instructions) {
+      if (ins.name() == info.ins.name() && ins.mode() == info.ins.mode()) {
+        // keep the operand number from the record
+        info.ins = ins;
+        seq = seq.add(info);
+        break;
+      }
+    }
+  }
+  return seq;
+}
+
+// Reads the instructions from a record in a result file.
+instruction_seq read_instructions(const uint8_t *buffer) {
+  return decode_instructions(buffer + hash_output_file::hash_size);
+}
+
+// The order that a bucket's representative is picked in: the fewest
+// bytes, then the lowest instructions as they're written in a record.
+// It doesn't depend on the order the sequences were written in.
+bool representative_order(const instruction_seq &a, const instruction_seq &b) {
+  if (a.bytes != b.bytes) { return a.bytes < b.bytes; }
+  for (int i = 0; i < 7; i++) {
+    const uint16_t x = a.instructions[i].data;
+    const uint16_t y = b.instructions[i].data;
+    if ((x & 0xFF) != (y & 0xFF)) { return (x & 0xFF) < (y & 0xFF); }
+    if ((x >> 8) != (y >> 8)) { return (x >> 8) < (y >> 8); }
+  }
+  return false;
+}
+
 void display_hash_result(uint8_t *buffer) {
   // diplay hash
   uint64_t hash = 0;
@@ -200,6 +628,686 @@ void display_hash_result(uint8_t *buffer) {
   std::cout << std::endl;
 }
 
+typedef struct bucket_counts {
+  uint64_t buckets = 0;
+  // Buckets with more than one sequence.
+  uint64_t shared = 0;
+  // Shared buckets where the sequences end in different states on the
+  // fingerprint machines, so they only share a fingerprint by collision.
+  uint64_t collisions = 0;
+} bucket_counts;
+
+/**
+ * Counts the buckets in a sorted result file, checking the shared
+ * buckets for fingerprint collisions.
+ */
+bucket_counts count_buckets(const std::string &file_name) {
+  bucket_counts counts;
+  std::ifstream file(file_name, std::ifstream::binary | std::ifstream::in);
+  uint8_t last_key[hash_output_file::hash_size_used];
+  instruction_seq first_seq;
+  random_machine_x16 first;
+  int bucket_size = 0;
+  bool collided = false;
+
+  auto finish_bucket = [&]() {
+    if (bucket_size > 1) { counts.shared++; }
+    if (collided) { counts.collisions++; }
+  };
+
+  while (!file.eof()) {
+    char buffer[hash_output_file::total_size * 256];
+    file.read(buffer, hash_output_file::total_size * 256);
+    std::streamsize data_size = file.gcount();
+    for (int j = 0; j < data_size; j += hash_output_file::total_size) {
+      uint8_t *record = (uint8_t*)(buffer + j);
+      if (bucket_size == 0 || memcmp(record, last_key, sizeof(last_key)) != 0) {
+        finish_bucket();
+        memcpy(last_key, record, sizeof(last_key));
+        counts.buckets++;
+        bucket_size = 0;
+        collided = false;
+        first_seq = read_instructions(record);
+      } else if (!collided) {
+        // Only run the first sequence once the bucket turns out to be shared.
+        if (bucket_size == 1) { first = run(first_seq); }
+        collided = any(~first.same_state(run(read_instructions(record))));
+      }
+      bucket_size++;
+    }
+  }
+  finish_bucket();
+  return counts;
+}
+
+/**
+ * Replaces the fingerprint of every sequence in a shared bucket of a
+ * sorted result file with refined_hash(), and sorts the bucket by it
+ * where it is. The file is still grouped by fingerprint afterwards,
+ * but a refined bucket's records stay between its neighbours instead
+ * of moving to where their new fingerprints sort in the whole file.
+ * Returns the number of buckets refined, and how many of them the
+ * refined fingerprint split.
+ */
+std::pair<uint64_t, uint64_t> refine_buckets(const std::string &file_name) {
+  std::fstream file(file_name, std::fstream::binary | std::fstream::in | std::fstream::out);
+  uint64_t refined = 0;
+  uint64_t split = 0;
+  // The records of the current bucket, and where it starts in the file.
+  std::vector<uint8_t> bucket;
+  std::streamoff bucket_start = 0;
+  std::streamoff position = 0;
+  // Where the next read starts.
+  std::streamoff read_position = 0;
+
+  auto finish_bucket = [&]() {
+    if (bucket.size() <= hash_output_file::total_size) { return; }
+    refined++;
+    for (size_t j = 0; j < bucket.size(); j += hash_output_file::total_size) {
+      execution_hash::buffer_t hash_buffer;
+      memcpy(hash_buffer.data(), &bucket[j], hash_buffer.size());
+      execution_hash hash = refined_hash(execution_hash::from_buffer(hash_buffer), read_instructions(&bucket[j]));
+      hash_buffer = hash.as_buffer();
+      memcpy(&bucket[j], hash_buffer.data(), hash_buffer.size());
+    }
+    // Stable, like radix_sort().
+    std::vector<size_t> order;
+    for (size_t j = 0; j < bucket.size(); j += hash_output_file::total_size) {
+      order.push_back(j);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return radix_less(&bucket[a], &bucket[b], hash_output_file::hash_size_used);
+    });
+    std::vector<uint8_t> sorted;
+    sorted.reserve(bucket.size());
+    for (size_t j : order) {
+      sorted.insert(sorted.end(), &bucket[j], &bucket[j] + hash_output_file::total_size);
+    }
+    if (memcmp(sorted.data(), &sorted[sorted.size() - hash_output_file::total_size], hash_output_file::hash_size_used) != 0) {
+      split++;
+    }
+    file.clear();
+    file.seekp(bucket_start);
+    file.write((char*)sorted.data(), sorted.size());
+    file.seekg(read_position);
+  };
+
+  while (true) {
+    char buffer[hash_output_file::total_size * 256];
+    file.read(buffer, hash_output_file::total_size * 256);
+    std::streamsize data_size = file.gcount();
+    if (data_size == 0) { break; }
+    read_position += data_size;
+    for (int j = 0; j < data_size; j += hash_output_file::total_size, position += hash_output_file::total_size) {
+      uint8_t *record = (uint8_t*)(buffer + j);
+      if (bucket.empty() || memcmp(record, bucket.data(), hash_output_file::hash_size_used) != 0) {
+        finish_bucket();
+        bucket.clear();
+        bucket_start = position;
+      }
+      bucket.insert(bucket.end(), record, record + hash_output_file::total_size);
+    }
+  }
+  finish_bucket();
+  return std::make_pair(refined, split);
+}
+
+void print_bucket_counts(const std::string &file_name) {
+  bucket_counts counts = count_buckets(file_name);
+  std::cout << "Buckets: " << counts.buckets
+    << ", shared: " << counts.shared
+    << ", with fingerprint collisions: " << counts.collisions << std::endl;
+}
+
+/**
+ * Reports how much each of the designed machines would split the
+ * shared buckets of a sorted result file. Every split is a group of
+ * sequences that only looked equivalent, which z3 would otherwise
+ * have to tell apart.
+ *
+ * Each machine is listed with the groups it adds on its own, then
+ * they are picked greedily, each time taking the machine that adds
+ * the most to the ones already picked, until none adds any more.
+ */
+void print_machine_report(const std::string &file_name) {
+  // The sequences in shared buckets, and the bucket each one is in.
+  std::vector<instruction_seq> sequences;
+  std::vector<uint64_t> buckets;
+  std::vector<instruction_seq> bucket;
+  uint64_t bucket_number = 0;
+  uint8_t last_key[hash_output_file::hash_size_used];
+
+  auto finish_bucket = [&]() {
+    if (bucket.size() > 1) {
+      sequences.insert(sequences.end(), bucket.begin(), bucket.end());
+      buckets.insert(buckets.end(), bucket.size(), bucket_number);
+    }
+    bucket.clear();
+    bucket_number++;
+  };
+
+  std::ifstream file(file_name, std::ifstream::binary | std::ifstream::in);
+  while (!file.eof()) {
+    char buffer[hash_output_file::total_size * 256];
+    file.read(buffer, hash_output_file::total_size * 256);
+    std::streamsize data_size = file.gcount();
+    for (int j = 0; j < data_size; j += hash_output_file::total_size) {
+      uint8_t *record = (uint8_t*)(buffer + j);
+      if (!bucket.empty() && memcmp(record, last_key, sizeof(last_key)) != 0) {
+        finish_bucket();
+      }
+      memcpy(last_key, record, sizeof(last_key));
+      bucket.push_back(read_instructions(record));
+    }
+  }
+  finish_bucket();
+
+  // The state each sequence ends in on each machine. stateHash()
+  // doesn't depend on the order of the writes, so it only differs when
+  // the states do.
+  const std::vector<designed_machine> machines = designed_machines();
+  std::vector<std::vector<uint32_t>> states(machines.size(), std::vector<uint32_t>(sequences.size()));
+  for (size_t j = 0; j < sequences.size(); j++) {
+    const compiled_sequence<random_machine> compiled(sequences[j]);
+    for (size_t i = 0; i < machines.size(); i++) {
+      random_machine machine = machines[i].machine;
+      compiled.run(machine);
+      states[i][j] = machine.stateHash();
+    }
+  }
+
+  // The number of groups once each group in labels is split by the
+  // states on a machine.
+  auto count_groups = [&](const std::vector<uint64_t> &labels, const std::vector<uint32_t> &split) {
+    std::vector<std::pair<uint64_t, uint32_t>> keys;
+    for (size_t j = 0; j < labels.size(); j++) {
+      keys.push_back(std::make_pair(labels[j], split.empty() ? 0 : split[j]));
+    }
+    std::sort(keys.begin(), keys.end());
+    return (uint64_t)(std::unique(keys.begin(), keys.end()) - keys.begin());
+  };
+
+  const uint64_t shared = count_groups(buckets, {});
+  std::cout << shared << " shared buckets with " << sequences.size() << " sequences" << std::endl;
+  std::cout << "Groups added by each machine:" << std::endl;
+  for (size_t i = 0; i < machines.size(); i++) {
+    std::cout << "  " << count_groups(buckets, states[i]) - shared << "\t" << machines[i].name << std::endl;
+  }
+
+  std::cout << "Picking greedily:" << std::endl;
+  std::vector<uint64_t> labels(buckets);
+  uint64_t groups = shared;
+  while (true) {
+    size_t best = 0;
+    uint64_t best_groups = groups;
+    for (size_t i = 0; i < machines.size(); i++) {
+      uint64_t split = count_groups(labels, states[i]);
+      if (split > best_groups) {
+        best = i;
+        best_groups = split;
+      }
+    }
+    if (best_groups == groups) { break; }
+    groups = best_groups;
+    for (size_t j = 0; j < labels.size(); j++) {
+      labels[j] = fnv_hash(states[best][j]).add(labels[j]).hash64();
+    }
+    std::cout << "  " << groups << "\t" << machines[best].name << std::endl;
+  }
+}
+
+// The fingerprint from before the kernels: fnv over each machine's
+// hash(), one byte at a time.
+uint64_t fnv_fingerprint(const random_machine_x16 &rms) {
+  fnv_hash hash_all(0x18480949);
+  const u32x16 hashes = rms.hash();
+  for (int i = 0; i < random_machine_x16::lanes; i++) {
+    hash_all.add((uint32_t)hashes[i]);
+  }
+  return hash_all.hash64();
+}
+
+template<typename kernel>
+uint64_t kernel_fingerprint(const random_machine_x16 &rms) {
+  return combine_lanes<kernel>(rms.fingerprint<kernel>(), 0x18480949, false);
+}
+
+// The average number of bits of a kernel's hash of one word that
+// change when one bit of the word changes, over all the bits and
+// over the worst bit. Both are 32 for a perfect hash.
+template<typename kernel>
+std::pair<double, double> avalanche(const std::vector<uint64_t> &words) {
+  double total = 0;
+  double worst = 64;
+  for (int bit = 0; bit < 64; bit++) {
+    uint64_t changed = 0;
+    for (uint64_t word : words) {
+      uint64_t a = kernel::finish(kernel::add(kernel::template start<uint64_t>(0), word));
+      uint64_t b = kernel::finish(kernel::add(kernel::template start<uint64_t>(0), (uint64_t)(word ^ (1ull << bit))));
+      changed += __builtin_popcountll(a ^ b);
+    }
+    double average = (double)changed / words.size();
+    total += average;
+    worst = std::min(worst, average);
+  }
+  return std::make_pair(total / 64, worst);
+}
+
+/**
+ * Compares the fingerprint kernels on the sequences of a result file.
+ * For each one, shows the time to hash the 16 machine states of a
+ * sequence, how many distinct fingerprints it gives, and how evenly
+ * the low and high bits of the distinct fingerprints spread over 1024
+ * buckets, as a chi-square that should be close to 1023.
+ */
+void print_hash_benchmark(const std::string &file_name) {
+  typedef uint64_t (*fingerprint_function)(const random_machine_x16&);
+  const std::vector<std::pair<std::string, fingerprint_function>> kernels = {
+    { "fnv over hash()", fnv_fingerprint },
+    { "fnv_kernel", kernel_fingerprint<fnv_kernel> },
+    { "mix_kernel", kernel_fingerprint<mix_kernel> },
+  };
+  const int max_sequences = 1 << 16;
+  const int repeats = 16;
+  std::vector<std::vector<uint64_t>> fingerprints(kernels.size());
+  std::vector<double> seconds(kernels.size());
+  // The packed registers of the first machine, to test avalanche with.
+  std::vector<uint64_t> words;
+
+  std::ifstream file(file_name, std::ifstream::binary | std::ifstream::in);
+  while (!file.eof() && words.size() < max_sequences) {
+    char buffer[hash_output_file::total_size * 256];
+    file.read(buffer, hash_output_file::total_size * 256);
+    std::streamsize data_size = file.gcount();
+    for (int j = 0; j < data_size && words.size() < max_sequences; j += hash_output_file::total_size) {
+      const random_machine_x16 state = run(read_instructions((uint8_t*)(buffer + j)));
+      words.push_back(state.packed_registers()[0]);
+      for (size_t k = 0; k < kernels.size(); k++) {
+        uint64_t fingerprint = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++) {
+          fingerprint ^= kernels[k].second(state) + r;
+        }
+        seconds[k] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        fingerprints[k].push_back(kernels[k].second(state));
+      }
+    }
+  }
+
+  std::cout << words.size() << " sequences" << std::endl;
+  for (size_t k = 0; k < kernels.size(); k++) {
+    std::vector<uint64_t> &distinct = fingerprints[k];
+    std::sort(distinct.begin(), distinct.end());
+    distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+    auto chi_square = [&](int shift) {
+      std::vector<uint64_t> buckets(1024);
+      for (uint64_t fingerprint : distinct) {
+        buckets[(fingerprint >> shift) & 1023]++;
+      }
+      double expected = (double)distinct.size() / buckets.size();
+      double result = 0;
+      for (uint64_t count : buckets) {
+        result += (count - expected) * (count - expected) / expected;
+      }
+      return result;
+    };
+    std::cout << kernels[k].first << ": "
+      << seconds[k] * 1e9 / repeats / words.size() << "ns a sequence, "
+      << distinct.size() << " distinct, chi-square low bits "
+      << chi_square(0) << ", high bits " << chi_square(54) << std::endl;
+  }
+  std::pair<double, double> fnv = avalanche<fnv_kernel>(words);
+  std::pair<double, double> mix = avalanche<mix_kernel>(words);
+  std::cout << "Bits changed by one bit of a word, average and worst: fnv_kernel "
+    << fnv.first << ", " << fnv.second << ", mix_kernel "
+    << mix.first << ", " << mix.second << std::endl;
+}
+
+/**
+ * Sorts a result file by fingerprint, then refines the shared buckets,
+ * which regroups each of them by the refined fingerprint in place.
+ * Checking the buckets for collisions takes another pass, so that's
+ * left to the `machines` report.
+ */
+void sort_result_file(const std::string &file_name) {
+  std::cout << "Sorting file:" << std::endl;
+  radix_sort(file_name.c_str(), hash_output_file::total_size, hash_output_file::hash_size_used * 8);
+  const std::pair<uint64_t, uint64_t> refined = refine_buckets(file_name);
+  std::cout << "Refined " << refined.first << " shared buckets, of which "
+    << refined.second << " were split" << std::endl;
+}
+
+typedef std::array<uint8_t, execution_hash::key_size> fingerprint_key;
+
+fingerprint_key key_of(const execution_hash &hash) {
+  const execution_hash::buffer_t buffer = hash.as_buffer();
+  fingerprint_key key;
+  memcpy(key.data(), buffer.data(), key.size());
+  return key;
+}
+
+/**
+ * The sequences of a layer in out/keys-<cost>.dat, so that the later
+ * layers can look them up without running them again. Each record has
+ * the fingerprint from hash(), which the file is sorted by, then the
+ * instructions. Only the shared buckets of a layer are refined, so the
+ * key in the result file isn't comparable with other layers, and the
+ * refined fingerprint is only worked out for the records a lookup
+ * finds with the same fingerprint.
+ *
+ * The file starts with a header of the record size, the settings that
+ * change what's in it, and the fingerprint of a test sequence, so that
+ * an index from a different build is written again instead of read.
+ */
+typedef struct key_index {
+  static const int key_size = execution_hash::key_size;
+  static const int total_size = key_size + hash_output_file::instructions_size;
+
+  typedef struct header {
+    uint32_t record_size = total_size;
+    uint32_t settings = fingerprint_bits | (canonical_only ? 0x10000 : 0);
+    fingerprint_key test_key = key_of(hash(test_sequence()));
+
+    bool operator==(const header &other) const {
+      return record_size == other.record_size && settings == other.settings && test_key == other.test_key;
+    }
+  } header;
+
+  // Reads and writes memory and flags, so that changes to how they're
+  // fingerprinted show up in its key.
+  static instruction_seq test_sequence() {
+    instruction_seq seq;
+    for (const auto &info : instructions) {
+      if (info.ins.name() == instruction_name::ADC || info.ins.name() == instruction_name::ROL ||
+          info.ins.name() == instruction_name::STA || info.ins.name() == instruction_name::PHP) {
+        seq = seq.add(info);
+      }
+    }
+    return seq;
+  }
+
+  static std::string file_name(int cost) {
+    return "out/keys-" + std::to_string(cost) + ".dat";
+  }
+
+  // Writes the index of a layer from its result file.
+  static void write(int cost) {
+    const std::string index_name = file_name(cost);
+    const std::string records_name = index_name + ".records";
+    {
+      std::ifstream file("out/result-" + std::to_string(cost) + ".dat", std::ifstream::binary | std::ifstream::in);
+      std::ofstream records(records_name, std::ofstream::binary | std::ofstream::out | std::ofstream::trunc);
+      while (file) {
+        char buffer[hash_output_file::total_size * 256];
+        file.read(buffer, hash_output_file::total_size * 256);
+        std::streamsize data_size = file.gcount();
+        for (int j = 0; j < data_size; j += hash_output_file::total_size) {
+          const instruction_seq seq = read_instructions((uint8_t*)(buffer + j));
+          const fingerprint_key key = key_of(hash(seq));
+          records.write((char*)key.data(), key.size());
+          hash_output_file::write_instructions(records, seq);
+        }
+      }
+    }
+    radix_sort(records_name.c_str(), total_size, key_size * 8);
+
+    std::ofstream index(index_name, std::ofstream::binary | std::ofstream::out | std::ofstream::trunc);
+    const header current;
+    index.write((const char*)&current, sizeof(current));
+    std::ifstream records(records_name, std::ifstream::binary | std::ifstream::in);
+    index << records.rdbuf();
+    records.close();
+    remove(records_name.c_str());
+  }
+
+  /**
+   * Maps the index of a layer, writing it first if it's missing or
+   * from a different build. Leaves the file unmapped if the layer has
+   * no sequences.
+   */
+  static void open(int cost, mapped_file &index) {
+    std::ifstream result("out/result-" + std::to_string(cost) + ".dat", std::ifstream::binary | std::ifstream::ate);
+    if (!result || result.tellg() <= 0) { return; }
+    if (index.open(file_name(cost)) && index.size >= sizeof(header)) {
+      header written;
+      memcpy(&written, index.data, sizeof(written));
+      if (written == header()) { return; }
+    }
+    index.close();
+    write(cost);
+    index.open(file_name(cost));
+  }
+
+  // The records of a mapped index, after its header.
+  static const uint8_t *records(const mapped_file &index) {
+    return index.data + sizeof(header);
+  }
+
+  static size_t count(const mapped_file &index) {
+    return index.size < sizeof(header) ? 0 : (index.size - sizeof(header)) / total_size;
+  }
+} key_index;
+
+/**
+ * The sequences of every layer cheaper than a cost, so that the ones
+ * that behave the same as a sequence of that cost can be found. Reads
+ * the key index of each layer that has sequences, and writes it first
+ * for a layer that hasn't been processed.
+ */
+typedef struct cheaper_sequences {
+  std::vector<mapped_file> layers;
+
+  cheaper_sequences(int cost) : layers(cost) {
+    for (int lower = 0; lower < cost; lower++) {
+      key_index::open(lower, layers[lower]);
+    }
+  }
+
+  typedef struct match {
+    operand_renaming renaming;
+    bool found;
+    instruction_seq cheaper;
+  } match;
+
+  /**
+   * Looks up the cheapest sequence that behaves the same, starting with
+   * the cheapest layer, and within it the first in representative_order
+   * so that it doesn't matter how the layer was ordered. The refined
+   * fingerprints are only worked out for the sequences with the same
+   * fingerprint from hash(). With pareto_optimal, only sequences of at
+   * most the given bytes are cheaper.
+   */
+  bool find(const instruction_seq &seq, uint8_t bytes, instruction_seq &cheaper) const {
+    const execution_hash seq_hash = hash(seq);
+    const fingerprint_key key = key_of(seq_hash);
+    bool refined_known = false;
+    fingerprint_key refined;
+    for (const mapped_file &layer : layers) {
+      const uint8_t *records = key_index::records(layer);
+      const size_t count = key_index::count(layer);
+      size_t low = 0;
+      size_t high = count;
+      while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if (radix_less(records + middle * key_index::total_size, key.data(), key_index::key_size)) {
+          low = middle + 1;
+        } else {
+          high = middle;
+        }
+      }
+      bool found_any = false;
+      for (; low < count; low++) {
+        const uint8_t *record = records + low * key_index::total_size;
+        if (memcmp(record, key.data(), key_index::key_size) != 0) { break; }
+        const instruction_seq found = decode_instructions(record + key_index::key_size);
+        if (pareto_optimal && found.bytes > bytes) { continue; }
+        if (found_any && !representative_order(found, cheaper)) { continue; }
+        if (!refined_known) {
+          refined = key_of(refined_hash(seq_hash, seq));
+          refined_known = true;
+        }
+        // Both fingerprints are the same, so refining either only
+        // differs in the sequence that's run.
+        if (key_of(refined_hash(seq_hash, found)) == refined) {
+          cheaper = found;
+          found_any = true;
+        }
+      }
+      if (found_any) { return true; }
+    }
+    return false;
+  }
+
+  /**
+   * The cheapest sequence that behaves the same as the sequence with
+   * its unknowns renamed, and the renaming. With canonical_only, the
+   * cheaper layers only hold canonical sequences, so each renaming of
+   * the sequence is looked up in place of each renaming of theirs.
+   */
+  match find(const instruction_seq &seq) const {
+    const std::vector<operand_renaming> options = canonical_only
+      ? renamings(seq)
+      : std::vector<operand_renaming>(1, identity_renaming());
+    match result { identity_renaming(), false, instruction_seq() };
+    for (const auto &renaming : options) {
+      if (find(rename_operands(seq, renaming), seq.bytes, result.cheaper)) {
+        result.renaming = renaming;
+        result.found = true;
+        break;
+      }
+    }
+    return result;
+  }
+} cheaper_sequences;
+
+/**
+ * Calls f with the records of each bucket of a sorted result file, one
+ * after another in a single buffer.
+ */
+template<typename F>
+void for_each_bucket(const std::string &file_name, F f) {
+  std::ifstream file(file_name, std::ifstream::binary | std::ifstream::in);
+  std::vector<uint8_t> bucket;
+  while (file) {
+    char buffer[hash_output_file::total_size * 256];
+    file.read(buffer, hash_output_file::total_size * 256);
+    std::streamsize data_size = file.gcount();
+    for (int j = 0; j < data_size; j += hash_output_file::total_size) {
+      uint8_t *record = (uint8_t*)(buffer + j);
+      if (!bucket.empty() && memcmp(record, bucket.data(), hash_output_file::hash_size_used) != 0) {
+        f(bucket);
+        bucket.clear();
+      }
+      bucket.insert(bucket.end(), record, record + hash_output_file::total_size);
+    }
+  }
+  if (!bucket.empty()) {
+    f(bucket);
+  }
+}
+
+/**
+ * Rewrites a sorted result file to hold one representative for each
+ * bucket: the sequence with the fewest bytes, then the lowest
+ * instructions. It's dropped as well if a sequence in a cheaper layer
+ * behaves the same, and with pareto_optimal isn't bigger. The other
+ * sequences go to out/equivalents-<cost>.dat with the key of their
+ * bucket, for finding rules in.
+ */
+void keep_representatives(int cost) {
+  const cheaper_sequences cheaper(cost);
+  const std::string file_name = "out/result-" + std::to_string(cost) + ".dat";
+  const std::string kept_name = file_name + ".representatives";
+  std::ofstream kept(kept_name, std::ofstream::binary | std::ofstream::out | std::ofstream::trunc);
+  std::ofstream equivalents("out/equivalents-" + std::to_string(cost) + ".dat", std::ofstream::binary | std::ofstream::out | std::ofstream::trunc);
+  uint64_t kept_count = 0;
+  uint64_t equivalent_count = 0;
+
+  for_each_bucket(file_name, [&](const std::vector<uint8_t> &bucket) {
+    size_t best = 0;
+    instruction_seq best_seq = read_instructions(&bucket[0]);
+    for (size_t j = hash_output_file::total_size; j < bucket.size(); j += hash_output_file::total_size) {
+      const instruction_seq seq = read_instructions(&bucket[j]);
+      if (representative_order(seq, best_seq)) {
+        best = j;
+        best_seq = seq;
+      }
+    }
+    bool dominated = cheaper.find(best_seq).found;
+    for (size_t j = 0; j < bucket.size(); j += hash_output_file::total_size) {
+      if (j == best && !dominated) {
+        kept.write((char*)&bucket[j], hash_output_file::total_size);
+        kept_count++;
+      } else {
+        equivalents.write((char*)&bucket[j], hash_output_file::total_size);
+        equivalent_count++;
+      }
+    }
+  });
+  kept.close();
+  rename(kept_name.c_str(), file_name.c_str());
+  std::cout << "Kept " << kept_count << " representatives, moved "
+    << equivalent_count << " equivalent sequences" << std::endl;
+}
+
+/**
+ * Proves which sequences of a sorted layer are non-optimal, and adds
+ * them to the set. Each sequence is compared with the cheapest sequence
+ * from a cheaper layer that behaves like some renaming of it, or
+ * failing that with the sequence with the fewest bytes in its bucket,
+ * and added if z3 says they can't end up different.
+ */
+void prove_non_optimal(int cost, non_optimal_set &non_optimal) {
+  const cheaper_sequences cheaper(cost);
+  z3::context c;
+  z3::solver s(c);
+  counterexample_set learned(counterexample_file);
+  uint64_t checked = 0;
+  uint64_t proven = 0;
+
+  // Renaming the unknowns of both sequences doesn't change whether
+  // they're the same, and the set keeps runs in canonical form, so the
+  // sequence can be passed in renamed.
+  auto prove = [&](const instruction_seq &seq, const instruction_seq *better) {
+    // The replacement can't be longer, or it might not fit where the
+    // sequence did.
+    if (better == nullptr || non_optimal_set::length(*better) > non_optimal_set::length(seq)) {
+      return false;
+    }
+    checked++;
+    if (canBeDifferent(s, learned, seq, *better) != z3::unsat) { return false; }
+    proven += non_optimal.add(seq);
+    return true;
+  };
+
+  const std::string file_name = "out/result-" + std::to_string(cost) + ".dat";
+  for_each_bucket(file_name, [&](const std::vector<uint8_t> &bucket) {
+    std::vector<instruction_seq> seqs;
+    for (size_t j = 0; j < bucket.size(); j += hash_output_file::total_size) {
+      seqs.push_back(read_instructions(&bucket[j]));
+    }
+    // The order within a bucket depends on the order the layer was
+    // written in, so the sequences are put in an order that doesn't.
+    std::sort(seqs.begin(), seqs.end(), representative_order);
+    // Every sequence in a bucket behaves the same, so renaming any of
+    // them the same way matches the same cheaper sequence, unless it
+    // has to be smaller as well.
+    const cheaper_sequences::match cheapest = cheaper.find(seqs[0]);
+    const instruction_seq *fewest_bytes = &seqs[0];
+    for (const auto &seq : seqs) {
+      if (non_optimal.contains_run_of(seq)) { continue; }
+      const cheaper_sequences::match match = pareto_optimal && seq.bytes != seqs[0].bytes
+        ? cheaper.find(seq)
+        : cheapest;
+      if (prove(rename_operands(seq, match.renaming), match.found ? &match.cheaper : nullptr)) { continue; }
+      if (seq.bytes > fewest_bytes->bytes) { prove(seq, fewest_bytes); }
+    }
+  });
+  learned.save();
+  std::cout << "Proved " << proven << " of " << checked << " candidates non-optimal, "
+    << non_optimal.runs.size() << " known" << std::endl;
+}
+
 typedef struct output_file_manager {
   uint8_t start;  
   std::vector<hash_output_file> outfiles;
@@ -215,6 +1323,172 @@ typedef struct output_file_manager {
   }
 } output_file_manager;
 
+/**
+ * A block of a layer, read in and decoded once to be extended by every
+ * variant of every instruction: its sequences, and whether each is
+ * skipped because it has exited or contains a non-optimal run. When
+ * pruning, the state of the non-optimal automaton after each sequence
+ * is kept, so that checking an extension is one more step. With stored
+ * states, the offset in the state file of the first state of each
+ * chunk is kept so that chunks can be read independently.
+ */
+typedef struct extension_block {
+  std::vector<instruction_seq> sequences;
+  std::vector<bool> exited;
+  std::vector<bool> non_optimal;
+  std::vector<non_optimal_automaton::state> automaton_states;
+  std::vector<size_t> state_offsets;
+
+  bool skipped(size_t record) const {
+    return exited[record] || non_optimal[record];
+  }
+
+  size_t chunks() const {
+    return (sequences.size() + extension_chunk_size - 1) / extension_chunk_size;
+  }
+} extension_block;
+
+/**
+ * A layer to extend, read a block at a time. With stored states, the
+ * state file is mapped into memory.
+ */
+typedef struct extension_layer {
+  std::ifstream file;
+  mapped_file states;
+  // Where the state of the next sequence read starts.
+  size_t state_offset = 0;
+
+  extension_layer(int cost) : file("out/result-" + std::to_string(cost) + ".dat", std::ifstream::binary | std::ifstream::in) {}
+
+  /**
+   * Maps the state file. Returns false if it doesn't line up with the
+   * result file, which is checked before anything is extended.
+   */
+  bool open_states(int cost) {
+    if (!states.open(hash_output_file::state_file_name(cost))) { return false; }
+    file.seekg(0, std::ifstream::end);
+    const size_t records = file.tellg() / hash_output_file::total_size;
+    file.seekg(0);
+    size_t offset = 0;
+    for (size_t record = 0; record < records; record++) {
+      size_t size = random_machine_x16::saved_size(states.data + offset, states.size - offset);
+      if (size == 0) { return false; }
+      offset += size;
+    }
+    return true;
+  }
+
+  // Reads the next block. Returns false once the whole layer is read.
+  bool read_block(const non_optimal_automaton &automaton, extension_block &block) {
+    block = extension_block();
+    while (file && block.sequences.size() < extension_block_size) {
+      char buffer[hash_output_file::total_size * 256];
+      const size_t wanted = std::min<size_t>(256, extension_block_size - block.sequences.size());
+      file.read(buffer, hash_output_file::total_size * wanted);
+      std::streamsize data_size = file.gcount();
+      for (int j = 0; j < data_size; j += hash_output_file::total_size) {
+        instruction_seq seq = read_instructions((uint8_t*)(buffer + j));
+        if (store_states) {
+          if (block.sequences.size() % extension_chunk_size == 0) {
+            block.state_offsets.push_back(state_offset);
+          }
+          state_offset += random_machine_x16::saved_size(states.data + state_offset, states.size - state_offset);
+        }
+        block.sequences.push_back(seq);
+        block.exited.push_back(has_exited(seq));
+        bool contains = false;
+        if (prune_non_optimal) {
+          block.automaton_states.push_back(automaton.read(seq, contains));
+        }
+        block.non_optimal.push_back(contains);
+      }
+    }
+    return !block.sequences.empty();
+  }
+} extension_layer;
+
+// What each thread keeps between the chunks it extends.
+typedef struct extension_worker {
+  emulator<random_machine_x16> emu;
+} extension_worker;
+
+// The records, and states if they're stored, from extending one chunk
+// by one instruction. They all have the same cost.
+typedef struct extension_output {
+  uint8_t cost;
+  std::ostringstream records;
+  std::ostringstream states;
+} extension_output;
+
+/**
+ * Extends a chunk of a layer by one instruction.
+ */
+void extend_chunk(int cost, const extension_layer &layer, const extension_block &block, size_t chunk, const instruction_info &next_instruction, const non_optimal_automaton &automaton, extension_worker &worker, extension_output &output) {
+  const size_t start = chunk * extension_chunk_size;
+  const size_t end = std::min(start + extension_chunk_size, block.sequences.size());
+  output.cost = cost + next_instruction.cycles;
+  const uint8_t *state = store_states ? layer.states.data + block.state_offsets[chunk] : nullptr;
+  for (size_t record = start; record < end; record++) {
+    const instruction_seq &prefix = block.sequences[record];
+    const instruction_seq seq = prefix.add(next_instruction);
+    // Only the renaming that keeps the sequence canonical is kept, and
+    // only the first order of its dependency graph.
+    const bool skipped = block.skipped(record) ||
+      (canonical_only && !extends_canonically(prefix, next_instruction.ins)) ||
+      (dependency_order_only && !extends_in_dependency_order(prefix, next_instruction.ins)) ||
+      (prune_dead_instructions && contains_dead_instruction(seq)) ||
+      seq.bytes > max_bytes;
+    if (store_states) {
+      // Resume from the saved state and run only the new instruction.
+      random_machine_x16 machine = initial_machines_x16;
+      machine.load(state);
+      state += random_machine_x16::saved_size(state, layer.states.data + layer.states.size - state);
+      if (skipped) { continue; }
+      worker.emu.instruction(machine, next_instruction.ins);
+      hash_output_file::write_record(output.records, hash(machine), seq);
+      machine.save(output.states);
+    } else {
+      if (skipped) { continue; }
+      if (prune_non_optimal && automaton.matches(automaton.step(block.automaton_states[record], seq, non_optimal_set::length(prefix)))) {
+        continue;
+      }
+      hash_output_file::write_record(output.records, hash(seq), seq);
+    }
+  }
+}
+
+/**
+ * Appends the output of each extension task to the result files in the
+ * order the tasks were made, whichever thread finishes them, so that
+ * the files are the same however many threads there are. Output that
+ * finishes early waits here for the tasks before it.
+ */
+typedef struct ordered_output {
+  output_file_manager &files;
+  std::mutex mutex;
+  std::map<size_t, std::unique_ptr<extension_output>> finished;
+  size_t next = 0;
+
+  ordered_output(output_file_manager &files) : files(files) {}
+
+  void finish(size_t task, std::unique_ptr<extension_output> output) {
+    std::lock_guard<std::mutex> lock(mutex);
+    finished[task] = std::move(output);
+    while (!finished.empty() && finished.begin()->first == next) {
+      const extension_output &done = *finished.begin()->second;
+      hash_output_file &file = files.get_file(done.cost);
+      const std::string records = done.records.str();
+      file.file.write(records.data(), records.size());
+      if (store_states) {
+        const std::string states = done.states.str();
+        file.states.write(states.data(), states.size());
+      }
+      finished.erase(finished.begin());
+      next++;
+    }
+  }
+} ordered_output;
+
 int main(int argc, char **argv) {
   if (argc < 2) {
     std::cerr << "Usage: " << std::endl;
@@ -227,24 +1501,25 @@ int main(int argc, char **argv) {
   if (arg1 == "init") {
     for (int i = 0; i <= max_cost; i++) {
       outfiles.push_back(hash_output_file(i, true));
+      remove(key_index::file_name(i).c_str());
     }
 
     std::cout << "Initializing" << std::endl;
     instruction_seq empty_seq;
-    auto hash_result = hash(empty_seq);
-    outfiles[0].write(hash_result, empty_seq);
+    outfiles[0].write(empty_seq);
 
     int total_instructions = 0;
     for (auto &instruction : instructions) {
       int variants = addr_mode_variants(instruction.ins.mode());
       for (int variant = 0; variant < variants; variant++) {
-        total_instructions++;
         instruction_seq seq;
         instruction_info instruction_variant = instruction;
         instruction_variant.ins = instruction_variant.ins.number(variant);
+        if (canonical_only && !extends_canonically(seq, instruction_variant.ins)) { continue; }
+        if (instruction_variant.bytes > max_bytes) { continue; }
+        total_instructions++;
         seq = seq.add(instruction_variant);
-        auto hash_result = hash(seq);
-        outfiles[seq.cycles].write(hash_result, seq);
+        outfiles[seq.cycles].write(seq);
       }
     }
 
@@ -262,62 +1537,158 @@ int main(int argc, char **argv) {
         display_hash_result((uint8_t*)(buffer + j));
       }
     }
+  } else if (arg1 == "rekey") {
+    // Regroups a result file by the components that are live, e.g.
+    // `rekey 40 xyC` to group as if A and all flags but carry are dead.
+    if (!component_hashes) {
+      std::cerr << "Rekeying needs the result files to have component hashes" << std::endl;
+      return 1;
+    }
+    if (argc < 4) {
+      std::cerr << "Usage: rekey <cost> <live components from axySVIDCZ>" << std::endl;
+      return 1;
+    }
+    int live = parse_live_mask(argv[3]);
+    if (live < 0) {
+      std::cerr << "Unknown component in " << argv[3] << ", expected some of axySVIDCZ" << std::endl;
+      return 1;
+    }
+    std::string file_name = std::string("out/result-") + argv[2] + ".dat";
+    std::fstream file(file_name, std::fstream::binary | std::fstream::in | std::fstream::out);
+    if (!file) {
+      std::cerr << "Couldn't open " << file_name << std::endl;
+      return 1;
+    }
+
+    // Replace the key of each record in place, then sort by the new key.
+    while (true) {
+      char buffer[hash_output_file::total_size * 256];
+      std::streampos start = file.tellg();
+      file.read(buffer, hash_output_file::total_size * 256);
+      std::streamsize data_size = file.gcount();
+      if (data_size == 0) { break; }
+      for (int j = 0; j < data_size; j += hash_output_file::total_size) {
+        execution_hash::buffer_t hash_buffer;
+        memcpy(hash_buffer.data(), buffer + j, hash_buffer.size());
+        execution_hash hash = execution_hash::from_buffer(hash_buffer);
+        hash.rekey(live);
+        hash_buffer = hash.as_buffer();
+        memcpy(buffer + j, hash_buffer.data(), hash_buffer.size());
+      }
+      file.clear();
+      file.seekp(start);
+      file.write(buffer, data_size);
+      file.seekg(start + data_size);
+    }
+    file.close();
+
+    std::cout << "Sorting file:" << std::endl;
+    radix_sort(file_name.c_str(), hash_output_file::total_size, hash_output_file::hash_size_used * 8);
+  } else if (arg1 == "hashes") {
+    if (argc < 3) {
+      std::cerr << "Usage: hashes <cost>" << std::endl;
+      return 1;
+    }
+    std::string file_name = std::string("out/result-") + argv[2] + ".dat";
+    if (!std::ifstream(file_name)) {
+      std::cerr << "Couldn't open " << file_name << std::endl;
+      return 1;
+    }
+    print_hash_benchmark(file_name);
+  } else if (arg1 == "machines") {
+    // Reports how many buckets of a layer that has already been
+    // processed are collisions, and how much the designed machines
+    // would split them.
+    if (argc < 3) {
+      std::cerr << "Usage: machines <cost>" << std::endl;
+      return 1;
+    }
+    std::string file_name = std::string("out/result-") + argv[2] + ".dat";
+    if (!std::ifstream(file_name)) {
+      std::cerr << "Couldn't open " << file_name << std::endl;
+      return 1;
+    }
+    print_bucket_counts(file_name);
+    print_machine_report(file_name);
   } else {
     int target = std::stoi(argv[1]);
     output_file_manager output_files(target + 1);
     std::string file_name = std::string("out/result-") + argv[1] + ".dat";
     std::cout << "Processing sequences with length " << target << std::endl;
  
-    // sort the file by hash
-    std::cout << "Sorting file:" << std::endl;
-    radix_sort(file_name.c_str(), hash_output_file::total_size, hash_output_file::hash_size_used * 8);
+    // sort the file by hash. With stored states, the file has to stay in
+    // the order it was written so that it lines up with the state file,
+    // so it is sorted after it has been extended instead.
+    if (!store_states) {
+      sort_result_file(file_name);
+    }
+    // Only read when pruning, so that the automaton is empty otherwise.
+    non_optimal_set non_optimal(prune_non_optimal ? non_optimal_file : "");
+    if (prune_non_optimal) {
+      prove_non_optimal(target, non_optimal);
+    }
+    const non_optimal_automaton automaton(non_optimal);
+    if (representatives_only) {
+      keep_representatives(target);
+    }
+    if (prune_non_optimal || representatives_only) {
+      key_index::write(target);
+    }
 
     ProfilerStart("gperf-profile.log");
 
-    std::ifstream view_file(file_name, std::ifstream::binary | std::ifstream::in);
-    // For each instruction type
-    for (const auto &ins_info : instructions) {
-      std::cout << "INSTRUCTION: " << (int)ins_info.ins.name() << std::endl;
-      int variants = addr_mode_variants(ins_info.ins.mode());
-      // For each variant of the instruction
-      for (int variant = 0; variant < variants; variant++) {
-        std::cout << "VARIANT: " << variant << std::endl;
-
-        view_file.clear();
-        view_file.seekg(0, std::ifstream::beg);
-        // For each section of the file
-        while (!view_file.eof()) {
-          char buffer[hash_output_file::total_size * 256];
-          view_file.read(buffer, hash_output_file::total_size * 256);
-          std::streamsize data_size = view_file.gcount();
-          // For each instruction sequence hash in the file
-          for (int buffer_start = 0; buffer_start < data_size; buffer_start += hash_output_file::total_size) {
-            uint8_t *buffer_ptr = (uint8_t*)(buffer + buffer_start);
-            instruction_seq seq;
-            // For each instruction in the sequence
-            for (int i = hash_output_file::hash_size; i < hash_output_file::total_size; i += 2) {
-              uint16_t data = buffer_ptr[i] | (buffer_ptr[i + 1] << 8);
-              instruction ins;
-              ins.data = data;
-              if (ins.name() == instruction_name::NONE) { break; }
-              for (const auto info : instructions) {
-                if (ins.name() == info.ins.name() && ins.mode() == info.ins.mode()) {
-                  seq = seq.add(info);
-                  break;
-                }
-              }
-            }
-
-            instruction_info next_instruction = ins_info;
-            next_instruction.ins = next_instruction.ins.number(variant);
-            seq = seq.add(next_instruction);
-            auto hash_result = hash(seq);
-            output_files.get_file(seq.cycles).write(hash_result, seq);
+    extension_layer layer(target);
+    if (store_states && !layer.open_states(target)) {
+      std::cerr << "The state file doesn't match " << file_name << std::endl;
+      return 1;
+    }
+
+    ordered_output output(output_files);
+    size_t tasks = 0;
+    uint64_t sequences = 0;
+    uint64_t exited = 0;
+    uint64_t non_optimal_sequences = 0;
+    extension_block block;
+    while (layer.read_block(automaton, block)) {
+      sequences += block.sequences.size();
+      exited += std::count(block.exited.begin(), block.exited.end(), true);
+      non_optimal_sequences += std::count(block.non_optimal.begin(), block.non_optimal.end(), true);
+
+      // One task for each chunk of the block and variant of an
+      // instruction, in the order a single thread would write them.
+      work_queue<extension_worker> queue;
+      for (const auto &ins_info : instructions) {
+        int variants = addr_mode_variants(ins_info.ins.mode());
+        for (int variant = 0; variant < variants; variant++) {
+          instruction_info next_instruction = ins_info;
+          next_instruction.ins = next_instruction.ins.number(variant);
+          for (size_t chunk = 0; chunk < block.chunks(); chunk++) {
+            const size_t task = tasks++;
+            queue.add([&, next_instruction, chunk, task](extension_worker &worker) {
+              std::unique_ptr<extension_output> result(new extension_output);
+              extend_chunk(target, layer, block, chunk, next_instruction, automaton, worker, *result);
+              output.finish(task, std::move(result));
+            });
           }
         }
       }
+      queue.run();
+    }
+    std::cout << "Extended " << sequences << " sequences in " << tasks << " tasks on " << N_THREADS << " threads" << std::endl;
+    // Sequences that have already exited weren't extended.
+    std::cout << exited << " of " << sequences << " sequences had exited and weren't extended" << std::endl;
+    // Neither were the ones that contain a non-optimal run, so only the
+    // runs that end with the new instruction needed to be checked.
+    if (prune_non_optimal) {
+      std::cout << non_optimal_sequences << " sequences were non-optimal and weren't extended" << std::endl;
     }
 
     ProfilerStop();
+
+    if (store_states) {
+      sort_result_file(file_name);
+      // The states no longer line up with the sorted file.
+      std::ofstream(hash_output_file::state_file_name(target), std::ofstream::trunc);
+    }
   }
 }
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <new>
+#include <sys/mman.h>
+#include "stdint.h"
+
+/**
+ * The initial memory of a set of random_machines, worked out once for
+ * every address. A read that misses a machine's write log then loads
+ * from its table instead of hashing the address.
+ *
+ * The tables are filled in by the constructor and only read after
+ * that, so any number of threads can share them. They're laid out
+ * one after another, table_size apart, which lets random_machine_x16
+ * read all of its lanes with one gather.
+ */
+typedef struct initial_memory_tables {
+  static constexpr size_t memory_size = 0x10000;
+  // Padded so that a 4 byte load at the last address of a table
+  // stays inside the mapping.
+  static constexpr size_t table_size = memory_size + 64;
+  static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+  uint8_t *memory = nullptr;
+  size_t mapped_size = 0;
+
+  /**
+   * Fills a table for each of the machines. With huge_pages, the
+   * tables are mapped on huge pages if any are reserved, and
+   * otherwise the kernel is asked to back them with transparent
+   * huge pages.
+   */
+  template<typename machine>
+  initial_memory_tables(const machine *machines, int count, bool huge_pages) {
+    if (count == 0) { return; }
+    mapped_size = (count * table_size + huge_page_size - 1) / huge_page_size * huge_page_size;
+    void *mapped = MAP_FAILED;
+    if (huge_pages) {
+      mapped = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (mapped == MAP_FAILED) {
+      mapped = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (mapped == MAP_FAILED) { throw std::bad_alloc(); }
+      if (huge_pages) { madvise(mapped, mapped_size, MADV_HUGEPAGE); }
+    }
+    memory = (uint8_t*)mapped;
+    for (int i = 0; i < count; i++) {
+      for (uint32_t addr = 0; addr < memory_size; addr++) {
+        memory[i * table_size + addr] = machines[i].fnv(addr);
+      }
+    }
+    mprotect(memory, mapped_size, PROT_READ);
+  }
+
+  initial_memory_tables(const initial_memory_tables&) = delete;
+  initial_memory_tables &operator=(const initial_memory_tables&) = delete;
+
+  ~initial_memory_tables() {
+    if (memory != nullptr) { munmap(memory, mapped_size); }
+  }
+
+  const uint8_t *table(int i) const {
+    return memory + i * table_size;
+  }
+} initial_memory_tables;
@@ -132,25 +132,20 @@ std::string addr_mode_operand_name(addr_mode mode, uint8_t number) {
 typedef struct instruction {
   uint16_t data;
 
-  instruction(): data(0) {}
-
-  instruction(instruction_name name, addr_mode mode, uint8_t number) {
-    data = (uint16_t)name;
-    data <<= 4;
-    data |= (uint16_t)mode;
-    data <<= 4;
-    data |= number;
-  }
+  constexpr instruction(): data(0) {}
+
+  constexpr instruction(instruction_name name, addr_mode mode, uint8_t number)
+    : data(((uint16_t)name << 8) | ((uint16_t)mode << 4) | number) {}
 
-  instruction_name name() const {
+  constexpr instruction_name name() const {
     return (instruction_name)((data & 0xFF00) >> 8);
   }
 
-  addr_mode mode() const {
+  constexpr addr_mode mode() const {
     return (addr_mode)((data & 0xF0) >> 4);
   }
 
-  uint8_t number() const {
+  constexpr uint8_t number() const {
     return data & 0xF;
   }
 
@@ -210,7 +205,7 @@ typedef struct instruction_seq {
   }
 } instruction_seq;
 
-static instruction_info instructions[] = {
+static constexpr instruction_info instructions[] = {
   { instruction(instruction_name::ADC, addr_mode::IMMEDIATE,   0), 20, 2, "adc.#" },
   { instruction(instruction_name::ADC, addr_mode::CONSTANT,    0), 20, 2, "adc.#" },
   { instruction(instruction_name::ADC, addr_mode::ZERO_PAGE,   0), 30, 2, "adc.z" },
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "stdint.h"
+
+/**
+ * A file mapped read-only into memory, so that it can be read any
+ * number of times, by any number of threads, without copying it.
+ */
+typedef struct mapped_file {
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+
+  mapped_file() {}
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file &operator=(const mapped_file&) = delete;
+
+  ~mapped_file() {
+    close();
+  }
+
+  void close() {
+    if (data != nullptr) { munmap((void*)data, size); }
+    data = nullptr;
+    size = 0;
+  }
+
+  // Returns false if the file couldn't be mapped. An empty file maps
+  // to no data.
+  bool open(const std::string &file_name) {
+    close();
+    int fd = ::open(file_name.c_str(), O_RDONLY);
+    if (fd < 0) { return false; }
+    struct stat info;
+    bool mapped = fstat(fd, &info) == 0;
+    if (mapped && info.st_size > 0) {
+      void *memory = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (memory == MAP_FAILED) {
+        mapped = false;
+      } else {
+        data = (const uint8_t*)memory;
+        size = info.st_size;
+      }
+    }
+    ::close(fd);
+    return mapped;
+  }
+} mapped_file;
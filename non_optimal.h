@@ -0,0 +1,264 @@
+#pragma once
+
+#include <array>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "stdint.h"
+#include "instructions2.h"
+#include "canonical.h"
+#include "fnv.h"
+
+/**
+ * Runs of instructions that z3 has proven to behave the same as a
+ * strictly cheaper sequence: fewer cycles, or the same cycles and
+ * fewer bytes, and no more instructions. With pareto_optimal, the
+ * cheaper sequence can't have more bytes either.
+ *
+ * Putting the cheaper sequence in place of the run makes anything that
+ * contains the run cheaper as well, so a sequence with one of these
+ * runs anywhere in it is never optimal and doesn't need to be
+ * enumerated. The same goes for any renaming of a run, so runs are
+ * kept and looked up in canonical form. They're saved to a file as
+ * they're found, so that each layer prunes with everything the cheaper
+ * layers proved.
+ */
+typedef struct non_optimal_set {
+  typedef std::array<uint16_t, 7> run;
+
+  struct run_hash {
+    size_t operator()(const run &r) const {
+      fnv_hash hash(0);
+      for (uint16_t data : r) {
+        hash.add(data);
+      }
+      return hash.hash64();
+    }
+  };
+
+  std::string file_name;
+  std::unordered_set<run, run_hash> runs;
+
+  // The file is a list of 14 byte records, the instructions of each run
+  // in the same layout as the result files.
+  non_optimal_set(const std::string &file_name) : file_name(file_name) {
+    std::ifstream file(file_name, std::ifstream::binary | std::ifstream::in);
+    uint8_t buffer[14];
+    while (file.read((char*)buffer, sizeof(buffer))) {
+      run r;
+      for (int i = 0; i < 7; i++) {
+        r[i] = buffer[2*i] | buffer[2*i + 1] << 8;
+      }
+      runs.insert(r);
+    }
+  }
+
+  // The number of instructions in a sequence.
+  static int length(const instruction_seq &seq) {
+    int length = 0;
+    while (length < 7 && seq.instructions[length].name() != instruction_name::NONE) {
+      length++;
+    }
+    return length;
+  }
+
+  // The canonical form of instructions [start, end) of the sequence.
+  static run as_run(const instruction_seq &seq, int start, int end) {
+    instruction_seq part;
+    for (int i = start; i < end; i++) {
+      part.instructions[i - start] = seq.instructions[i];
+    }
+    part = canonicalize(part);
+    run r;
+    for (int i = 0; i < 7; i++) {
+      r[i] = part.instructions[i].data;
+    }
+    return r;
+  }
+
+  /**
+   * Adds a sequence that has been proven non-optimal, and saves it if
+   * it's new. Returns whether it was new.
+   */
+  bool add(const instruction_seq &seq) {
+    run r = as_run(seq, 0, 7);
+    if (!runs.insert(r).second) { return false; }
+    std::ofstream file(file_name, std::ofstream::binary | std::ofstream::out | std::ofstream::app);
+    for (uint16_t data : r) {
+      file.put(data);
+      file.put(data >> 8);
+    }
+    return true;
+  }
+
+  /**
+   * True if any run of consecutive instructions in the sequence,
+   * including the whole sequence, is known to be non-optimal.
+   */
+  bool contains_run_of(const instruction_seq &seq) const {
+    if (runs.empty()) { return false; }
+    const int n = length(seq);
+    for (int end = 1; end <= n; end++) {
+      if (ends_with_run_of(seq, end)) { return true; }
+    }
+    return false;
+  }
+
+  /**
+   * True if a run that ends with the last of the first `end`
+   * instructions is non-optimal. When a sequence is extended by one
+   * instruction, these are the only runs that are new.
+   */
+  bool ends_with_run_of(const instruction_seq &seq, int end) const {
+    for (int start = 0; start < end; start++) {
+      if (runs.count(as_run(seq, start, end))) { return true; }
+    }
+    return false;
+  }
+} non_optimal_set;
+
+/**
+ * The runs of a non_optimal_set compiled into an Aho-Corasick
+ * automaton, so that checking a sequence for every run that ends with
+ * its last instruction is one step from the state of the sequence
+ * before it, however many runs there are.
+ *
+ * To match every renaming of a run, each unknown is written as the
+ * distance back to the last instruction that used the same one, or 0
+ * if nothing before it in the run did (Baker's prev encoding). Two runs
+ * are renamings of each other exactly when they encode the same. A
+ * distance that reaches back past the start of the run being matched
+ * is read as 0, so an instruction encodes differently depending on the
+ * depth of the state it's read at.
+ */
+typedef struct non_optimal_automaton {
+  typedef uint32_t state;
+  static constexpr state start = 0;
+
+  typedef struct node {
+    state fail;
+    uint8_t depth;
+    // A run ends here, or at a state on the chain of fail links.
+    bool match;
+  } node;
+
+  std::vector<node> nodes;
+  // Edges by (state << 16 | symbol).
+  std::unordered_map<uint64_t, state> edges;
+
+  non_optimal_automaton(const non_optimal_set &set) {
+    nodes.push_back(node { start, 0, false });
+    std::vector<std::vector<std::pair<uint16_t, state>>> children(1);
+    for (const auto &r : set.runs) {
+      instruction_seq seq;
+      for (int i = 0; i < 7; i++) {
+        seq.instructions[i].data = r[i];
+      }
+      state s = start;
+      for (int i = 0; i < non_optimal_set::length(seq); i++) {
+        uint16_t symbol = encode(seq.instructions[i], distance(seq, i), i);
+        auto edge = edges.find(key(s, symbol));
+        if (edge != edges.end()) {
+          s = edge->second;
+          continue;
+        }
+        state child = nodes.size();
+        nodes.push_back(node { start, (uint8_t)(i + 1), false });
+        children.push_back({});
+        children[s].push_back(std::make_pair(symbol, child));
+        edges[key(s, symbol)] = child;
+        s = child;
+      }
+      nodes[s].match = true;
+    }
+
+    // Fail links, breadth first so that each state's parent and the
+    // states its fail link can lead to are done before it.
+    std::vector<state> queue;
+    for (const auto &child : children[start]) {
+      queue.push_back(child.second);
+    }
+    for (size_t i = 0; i < queue.size(); i++) {
+      state parent = queue[i];
+      for (const auto &child : children[parent]) {
+        // The edge's symbol holds the distance as seen from the
+        // parent's depth, which is as far back as any fail link needs.
+        instruction ins;
+        ins.data = child.first;
+        uint8_t back = operand_kind(ins.mode()) >= 0 ? ins.number() : 0;
+        state fail = step(nodes[parent].fail, ins, back);
+        nodes[child.second].fail = fail;
+        nodes[child.second].match |= nodes[fail].match;
+        queue.push_back(child.second);
+      }
+    }
+  }
+
+  static uint64_t key(state s, uint16_t symbol) {
+    return (uint64_t)s << 16 | symbol;
+  }
+
+  /**
+   * How many instructions back the unknown of instruction i of the
+   * sequence was last used, or 0 if it hasn't been or it isn't an
+   * unknown.
+   */
+  static uint8_t distance(const instruction_seq &seq, int i) {
+    const instruction ins = seq.instructions[i];
+    const int kind = operand_kind(ins.mode());
+    if (kind < 0) { return 0; }
+    for (int j = i - 1; j >= 0; j--) {
+      const instruction before = seq.instructions[j];
+      if (operand_kind(before.mode()) == kind && before.number() == ins.number()) {
+        return i - j;
+      }
+    }
+    return 0;
+  }
+
+  // The symbol for an instruction read at a state of the given depth.
+  static uint16_t encode(instruction ins, uint8_t distance, int depth) {
+    if (operand_kind(ins.mode()) < 0) { return ins.data; }
+    return (ins.data & 0xFFF0) | (distance <= depth ? distance : 0);
+  }
+
+  /**
+   * The state after reading an instruction, given how far back its
+   * unknown was last used.
+   */
+  state step(state s, instruction ins, uint8_t distance) const {
+    while (true) {
+      auto edge = edges.find(key(s, encode(ins, distance, nodes[s].depth)));
+      if (edge != edges.end()) { return edge->second; }
+      if (s == start) { return start; }
+      s = nodes[s].fail;
+    }
+  }
+
+  // The state after adding instruction i of the sequence to the state
+  // of the instructions before it.
+  state step(state s, const instruction_seq &seq, int i) const {
+    return step(s, seq.instructions[i], distance(seq, i));
+  }
+
+  // True if a run ends with the last instruction read.
+  bool matches(state s) const {
+    return nodes[s].match;
+  }
+
+  /**
+   * Reads a whole sequence. Returns the state after it, and sets
+   * contains if any run of it is non-optimal.
+   */
+  state read(const instruction_seq &seq, bool &contains) const {
+    state s = start;
+    contains = false;
+    for (int i = 0; i < non_optimal_set::length(seq); i++) {
+      s = step(s, seq, i);
+      contains |= matches(s);
+    }
+    return s;
+  }
+} non_optimal_automaton;
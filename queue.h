@@ -1,6 +1,9 @@
+#pragma once
+
 #include <functional>
 #include <vector>
 #include <mutex>
+#include <thread>
 
 static const int N_THREADS = std::thread::hardware_concurrency();
 
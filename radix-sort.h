@@ -11,6 +11,15 @@ static inline bool get_bit(const char *buf, const int bit) {
   return (byte >> (bit % 8)) & 1;
 }
 
+// Whether record a comes before record b in the order radix_sort()
+// leaves them in, by their first bytes as a little endian number.
+static inline bool radix_less(const uint8_t *a, const uint8_t *b, const int bytes) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    if (a[i] != b[i]) { return a[i] < b[i]; }
+  }
+  return false;
+}
+
 static void radix_sort(const char *file, const uint8_t size, const uint8_t bits) {
   const int buffer_size = size * 256;
 
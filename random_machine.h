@@ -1,7 +1,10 @@
 
 #pragma once
 
+#include <vector>
 #include "instructions2.h"
+#include "simd.h"
+#include "state_hash.h"
 #include "stdint.h"
 #include "string.h"
 
@@ -83,11 +86,19 @@ struct random_machine {
 
   uint32_t seed;
   uint32_t earlyExit = 0;
-  
-  uint16_t writtenAddresses[NUM_ADDRESSES];
 
-  uint8_t writtenValues[NUM_ADDRESSES];
+  // The machine's initial memory from initial_memory_tables, which
+  // memory that hasn't been written is read from instead of fnv(), or
+  // null. The tables have to outlive the machine.
+  const uint8_t *initialMemory = nullptr;
+  
+  // The write log. The first NUM_ADDRESSES addresses are loaded as one
+  // vector so that they can all be compared with the address in a
+  // single instruction. Any addresses after that spill into a list.
+  uint16_t writtenAddresses[NUM_ADDRESSES] = {};
+  uint8_t writtenValues[NUM_ADDRESSES] = {};
   uint8_t numAddressesWritten = 0;
+  std::vector<std::pair<uint16_t, uint8_t>> spilledWrites;
 
   uint8_t _a;
   uint8_t _x;
@@ -131,21 +142,125 @@ struct random_machine {
   bool ccC(bool val) { E return _ccC = val; }
   bool ccZ(bool val) { E return _ccZ = val; }
 
+  bool ccS() const { return _ccS; }
+  bool ccV() const { return _ccV; }
+  bool ccI() const { return _ccI; }
+  bool ccD() const { return _ccD; }
+  bool ccC() const { return _ccC; }
+  bool ccZ() const { return _ccZ; }
+
+  uint8_t setSZ(uint8_t val) {
+    if (earlyExit != 0) { return val; }
+    _ccS = val >= 0x80;
+    _ccZ = val == 0;
+    return val;
+  }
+
+  // Sets V for the addition of operand to a giving result.
+  bool setV(uint8_t a, uint8_t operand, uint8_t result) {
+    E
+    return _ccV = ((result ^ a) & (result ^ operand) & 0x80) != 0;
+  }
+
+  /**
+   * A hash of the state: the xor of a random key for each register,
+   * flag and the exit with its value, and for each written address,
+   * the key for its value xored with the key for its initial value.
+   * Unlike hash(), it doesn't depend on the order the memory was
+   * written in, so it only differs when the states do.
+   */
+  uint32_t stateHash() const {
+    uint32_t hash = stateKey(STATE_A, _a) ^ stateKey(STATE_X, _x)
+      ^ stateKey(STATE_Y, _y) ^ stateKey(STATE_SP, _sp)
+      ^ stateKey(STATE_CCS, ccS()) ^ stateKey(STATE_CCV, ccV())
+      ^ stateKey(STATE_CCI, _ccI) ^ stateKey(STATE_CCD, _ccD)
+      ^ stateKey(STATE_CCC, _ccC) ^ stateKey(STATE_CCZ, ccZ())
+      ^ stateKey(STATE_EXIT, earlyExit);
+    auto memory = [&](uint16_t address, uint8_t value) {
+      hash ^= stateKey(STATE_MEMORY + address, value)
+        ^ stateKey(STATE_MEMORY + address, initial(address));
+    };
+    for (int i = 0; i < numAddressesWritten; i++) {
+      memory(writtenAddresses[i], writtenValues[i]);
+    }
+    for (const auto &spilled : spilledWrites) {
+      memory(spilled.first, spilled.second);
+    }
+    return hash;
+  }
+
+  // The components of the state that have their own keys. Memory
+  // addresses are STATE_MEMORY + address.
+  enum state_component : uint32_t {
+    STATE_A, STATE_X, STATE_Y, STATE_SP,
+    STATE_CCS, STATE_CCV, STATE_CCI, STATE_CCD, STATE_CCC, STATE_CCZ,
+    STATE_EXIT,
+    STATE_MEMORY = 0x10000,
+  };
+
+  // The random key for a component having a value.
+  static uint32_t stateKey(uint32_t component, uint32_t value) {
+    const uint64_t x = (((uint64_t)component << 32) | value) * 0x9E3779B97F4A7C15u;
+    return (uint32_t)((x ^ (x >> 29)) * 0xBF58476D1CE4E5B9u >> 32);
+  }
+
   // Reading on the concrete machine uses a randomly
   // filled memory space using the fnv hash.
   // It also remembers previous stores and returns
   // consistent results.
   uint8_t read(uint16_t addr) const {
-    for (int i = 0; i < numAddressesWritten; i++) {
-      if (writtenAddresses[i] == addr) return writtenValues[i];
+    int i = findWritten(addr);
+    if (i < 0) {
+      return initial(addr);
+    } else if (i < NUM_ADDRESSES) {
+      return writtenValues[i];
     }
-    return fnv(addr);
+    return spilledWrites[i - NUM_ADDRESSES].second;
   }
 
-  uint8_t setSZ(uint8_t val) {
-    ccS(val >= 0x80);
-    ccZ(val == 0);
-    return val;
+  uint8_t initial(uint16_t addr) const {
+    return initialMemory != nullptr ? initialMemory[addr] : fnv(addr);
+  }
+
+  // Returns the position of addr in the write log, counting
+  // the spilled addresses after the first NUM_ADDRESSES, or -1
+  // if it hasn't been written.
+  int findWritten(uint16_t addr) const {
+    static_assert(NUM_ADDRESSES == 16, "The write log is searched as one 16 lane vector");
+    // memcpy rather than a u16x16 member, which would make
+    // random_machine need 32 byte alignment.
+    u16x16 addresses;
+    memcpy(&addresses, writtenAddresses, sizeof(addresses));
+    uint32_t hits = movemask(convert<b8x16>(addresses == addr));
+    hits &= (1u << numAddressesWritten) - 1;
+    if (hits != 0) {
+      return __builtin_ctz(hits);
+    }
+    for (size_t i = 0; i < spilledWrites.size(); i++) {
+      if (spilledWrites[i].first == addr) { return NUM_ADDRESSES + i; }
+    }
+    return -1;
+  }
+
+  // True if the machines are in the same state. Memory is compared
+  // by address, so the order of the writes doesn't matter. Both
+  // machines must start from the same seed.
+  bool same_state(const random_machine &other) const {
+    if (earlyExit != other.earlyExit ||
+        _a != other._a || _x != other._x || _y != other._y || _sp != other._sp ||
+        ccS() != other.ccS() || ccV() != other.ccV() || ccI() != other.ccI() ||
+        ccD() != other.ccD() || ccC() != other.ccC() || ccZ() != other.ccZ()) {
+      return false;
+    }
+    for (const random_machine *m : { this, &other }) {
+      for (int i = 0; i < m->numAddressesWritten; i++) {
+        if (read(m->writtenAddresses[i]) != other.read(m->writtenAddresses[i])) { return false; }
+      }
+      for (const auto &spilled : m->spilledWrites) {
+        if (read(spilled.first) != other.read(spilled.first)) { return false; }
+      }
+    }
+    return true;
   }
 
   bool uge(uint8_t first, uint8_t second) const {
@@ -176,13 +291,17 @@ struct random_machine {
   // consistent results.
   uint8_t write(uint16_t addr, uint8_t val) {
     E
-    for (int i = 0; i < numAddressesWritten; i++) {
-      if (addr == writtenAddresses[i]) {
-        return writtenValues[i] = val;
-      }
+    int i = findWritten(addr);
+    if (i >= NUM_ADDRESSES) {
+      return spilledWrites[i - NUM_ADDRESSES].second = val;
+    } else if (i >= 0) {
+      return writtenValues[i] = val;
+    } else if (numAddressesWritten < NUM_ADDRESSES) {
+      writtenAddresses[numAddressesWritten] = addr;
+      return writtenValues[numAddressesWritten++] = val;
     }
-    writtenAddresses[numAddressesWritten] = addr;
-    return writtenValues[numAddressesWritten++] = val;
+    spilledWrites.push_back(std::make_pair(addr, val));
+    return val;
   }
 
 #undef E
@@ -226,24 +345,62 @@ struct random_machine {
     h(_x);
     h(_y);
     h(_sp);
-    h(_ccS);
-    h(_ccV);
-    h(_ccI);
-    h(_ccD);
-    h(_ccC);
-    h(_ccZ);
+    h(ccS());
+    h(ccV());
+    h(ccI());
+    h(ccD());
+    h(ccC());
+    h(ccZ());
 
     // For each changed address hash the address and value.
     for (int i = 0; i < numAddressesWritten; i++) {
       auto address = writtenAddresses[i];
       auto value = writtenValues[i];
-      if (value != fnv(address)) {
+      if (value != initial(address)) {
         h(address);
         h(value);
       }
     }
+    for (const auto &spilled : spilledWrites) {
+      if (spilled.second != initial(spilled.first)) {
+        h(spilled.first);
+        h(spilled.second);
+      }
+    }
     h(earlyExit);
 #undef h
     return hash;
   }
+
+  // The registers, flags and exit, packed into one word.
+  uint64_t packed_registers() const {
+    return (uint64_t)_a | (uint64_t)_x << 8 | (uint64_t)_y << 16 | (uint64_t)_sp << 24
+      | (uint64_t)ccS() << 32 | (uint64_t)ccV() << 33 | (uint64_t)ccI() << 34
+      | (uint64_t)ccD() << 35 | (uint64_t)ccC() << 36 | (uint64_t)ccZ() << 37
+      | (uint64_t)earlyExit << 40;
+  }
+
+  /**
+   * Like hash(), but hashes whole words with one of the kernels in
+   * state_hash.h: the packed registers, then the address and value
+   * of each changed address as one word.
+   */
+  template<typename kernel>
+  uint64_t fingerprint(uint64_t seed = 0) const {
+    uint64_t hash = kernel::template start<uint64_t>(seed);
+    hash = kernel::add(hash, packed_registers());
+    auto memory = [&](uint16_t address, uint8_t value) {
+      if (value != initial(address)) {
+        hash = kernel::add(hash, (uint64_t)address << 8 | value);
+      }
+    };
+    for (int i = 0; i < numAddressesWritten; i++) {
+      memory(writtenAddresses[i], writtenValues[i]);
+    }
+    for (const auto &spilled : spilledWrites) {
+      memory(spilled.first, spilled.second);
+    }
+    return kernel::finish(hash);
+  }
 };
+
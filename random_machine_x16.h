@@ -0,0 +1,488 @@
+#pragma once
+
+#include <iostream>
+#include <stdexcept>
+#include "instructions2.h"
+#include "random_machine.h"
+#include "simd.h"
+
+/**
+ * random_machine_x16 runs 16 random_machines at once, one per
+ * vector lane. Each register, flag and write log entry is stored
+ * as a vector with one element per machine, so the emulator decodes
+ * an instruction once and executes it on all 16 machines.
+ *
+ * Lane i behaves exactly like the random_machine it was built from,
+ * including the hash it produces.
+ */
+struct random_machine_x16 {
+  static constexpr int lanes = 16;
+  static const bool falsy = false;
+  static const bool truthy = true;
+
+  random_machine_x16() {}
+
+  random_machine_x16(const random_machine (&machines)[lanes]) {
+    for (int i = 0; i < lanes; i++) {
+      const random_machine &m = machines[i];
+      init[i] = m.init;
+      seedZero[i] = m.seed == 0 ? -1 : 0;
+      seedOnes[i] = m.seed == 0xFFFFFFFF ? -1 : 0;
+      for (int j = 0; j < 4; j++) {
+        absoluteVars[j][i] = m.absoluteVars[j];
+        zpVars[j][i] = m.zpVars[j];
+        immediateVars[j][i] = m.immediateVars[j];
+      }
+      _a[i] = m._a;
+      _x[i] = m._x;
+      _y[i] = m._y;
+      _sp[i] = m._sp;
+      _ccS[i] = m.ccS() ? -1 : 0;
+      _ccV[i] = m.ccV() ? -1 : 0;
+      _ccI[i] = m.ccI() ? -1 : 0;
+      _ccD[i] = m.ccD() ? -1 : 0;
+      _ccC[i] = m.ccC() ? -1 : 0;
+      _ccZ[i] = m.ccZ() ? -1 : 0;
+      earlyExit[i] = m.earlyExit;
+      if (!m.spilledWrites.empty()) {
+        throw std::length_error("random_machine_x16 has no room for spilled writes");
+      }
+      numAddressesWritten[i] = m.numAddressesWritten;
+      for (int j = 0; j < m.numAddressesWritten; j++) {
+        writtenAddresses[j][i] = m.writtenAddresses[j];
+        writtenValues[j][i] = m.writtenValues[j];
+      }
+      if (m.numAddressesWritten > maxAddressesWritten) {
+        maxAddressesWritten = m.numAddressesWritten;
+      }
+    }
+    live = convert<b8x16>(earlyExit == 0);
+
+    // The initial memory can be gathered from the tables when every
+    // lane has one, and they're close enough to index from the first.
+    initialMemory = machines[0].initialMemory;
+    for (int i = 0; i < lanes && initialMemory != nullptr; i++) {
+      ptrdiff_t offset = machines[i].initialMemory - machines[0].initialMemory;
+      if (machines[i].initialMemory == nullptr || offset < INT32_MIN || offset > INT32_MAX - 0xFFFF) {
+        initialMemory = nullptr;
+      }
+      initialMemoryOffsets[i] = offset;
+    }
+  }
+
+  u16x16 absoluteVars[4];
+  u16x16 absolute(uint8_t number) const {
+    return absoluteVars[number];
+  }
+
+  u8x16 zpVars[4];
+  u8x16 zp(uint8_t number) const {
+    return zpVars[number];
+  }
+
+  u8x16 immediateVars[4];
+  u8x16 immediate(uint8_t number) const {
+    return immediateVars[number];
+  }
+
+  u8x16 constant(uint8_t number) const {
+    return u8x16{} + number;
+  }
+
+  void instruction(instruction op) {
+    emulator<random_machine_x16> emu;
+    emu.instruction(*this, op);
+  }
+
+  // The per-lane fnv state, and which lanes have the special
+  // all-zero and all-one seeds.
+  u32x16 init;
+  b32x16 seedZero;
+  b32x16 seedOnes;
+
+  // The initial memory tables of the lanes, as offsets from the first
+  // lane's table, or null to use fnv().
+  const uint8_t *initialMemory = nullptr;
+  b32x16 initialMemoryOffsets = b32x16{};
+
+  u32x16 earlyExit = u32x16{};
+  // Lanes which haven't exited yet. Only these lanes are changed.
+  b8x16 live = ~b8x16{};
+
+  // Lane i of writtenAddresses[j] is the jth address written by machine i.
+  // Only the first numAddressesWritten[i] entries are valid for machine i.
+  static_assert(NUM_ADDRESSES >= 7, "Every write of a 7 instruction sequence must fit in the log");
+  u16x16 writtenAddresses[NUM_ADDRESSES];
+  u8x16 writtenValues[NUM_ADDRESSES];
+  u8x16 numAddressesWritten = u8x16{};
+  uint8_t maxAddressesWritten = 0;
+
+  u8x16 _a;
+  u8x16 _x;
+  u8x16 _y;
+  u8x16 _sp;
+  b8x16 _ccS;
+  b8x16 _ccV;
+  b8x16 _ccI;
+  b8x16 _ccD;
+  b8x16 _ccC;
+  b8x16 _ccZ;
+
+  // Exits every live lane where cond is set with the given code.
+  void exit(b32x16 cond, u32x16 code) {
+    cond &= convert<b32x16>(live);
+    earlyExit = cond ? code : earlyExit;
+    live = convert<b8x16>(earlyExit == 0);
+  }
+
+  void rts() {
+    exit(~b32x16{}, u32x16{} + 0x0001);
+  }
+  void rti() {
+    exit(~b32x16{}, u32x16{} + 0x0002);
+  }
+  void jmp(u16x16 target) {
+    exit(~b32x16{}, convert<u32x16>(target) | 0x10000);
+  }
+  void branch(b8x16 cond, u16x16 target) {
+    exit(convert<b32x16>(cond), convert<u32x16>(target) | 0x10000);
+  }
+
+  // Every assignment only affects the lanes which haven't exited.
+  u8x16 a(u8x16 val) { return _a = live ? val : _a; }
+  u8x16 x(u8x16 val) { return _x = live ? val : _x; }
+  u8x16 y(u8x16 val) { return _y = live ? val : _y; }
+  u8x16 sp(u8x16 val) { return _sp = live ? val : _sp; }
+  b8x16 ccS(b8x16 val) { return _ccS = live ? val : _ccS; }
+  b8x16 ccV(b8x16 val) { return _ccV = live ? val : _ccV; }
+  b8x16 ccI(b8x16 val) { return _ccI = live ? val : _ccI; }
+  b8x16 ccD(b8x16 val) { return _ccD = live ? val : _ccD; }
+  b8x16 ccC(b8x16 val) { return _ccC = live ? val : _ccC; }
+  b8x16 ccZ(b8x16 val) { return _ccZ = live ? val : _ccZ; }
+  b8x16 ccS(bool val) { return ccS(val ? ~b8x16{} : b8x16{}); }
+  b8x16 ccV(bool val) { return ccV(val ? ~b8x16{} : b8x16{}); }
+  b8x16 ccI(bool val) { return ccI(val ? ~b8x16{} : b8x16{}); }
+  b8x16 ccD(bool val) { return ccD(val ? ~b8x16{} : b8x16{}); }
+  b8x16 ccC(bool val) { return ccC(val ? ~b8x16{} : b8x16{}); }
+  b8x16 ccZ(bool val) { return ccZ(val ? ~b8x16{} : b8x16{}); }
+  b8x16 ccS() const { return _ccS; }
+  b8x16 ccV() const { return _ccV; }
+  b8x16 ccI() const { return _ccI; }
+  b8x16 ccD() const { return _ccD; }
+  b8x16 ccC() const { return _ccC; }
+  b8x16 ccZ() const { return _ccZ; }
+
+  // The same as random_machine::fnv, for each lane.
+  u32x16 fnv(u16x16 value) const {
+    u32x16 v = convert<u32x16>(value);
+    u32x16 hash = init;
+    hash = hash ^ (v & 0xFF);
+    hash = hash * 16777619;
+    hash = hash ^ (v >> 8);
+    hash = hash * 16777619;
+    hash = seedZero ? u32x16{} : hash;
+    hash = seedOnes ? ~u32x16{} : hash;
+    return hash;
+  }
+
+  // The same as random_machine::initial, for each lane.
+  u8x16 initial(u16x16 addr) const {
+    if (initialMemory == nullptr) {
+      return convert<u8x16>(fnv(addr));
+    }
+    b32x16 index = initialMemoryOffsets + convert<b32x16>(addr);
+#ifdef __AVX512F__
+    // Loads 4 bytes at each address, which the tables are padded for.
+    return convert<u8x16>((u32x16)_mm512_mask_i32gather_epi32(_mm512_setzero_si512(), 0xFFFF, (__m512i)index, initialMemory, 1));
+#else
+    u8x16 result;
+    for (int i = 0; i < lanes; i++) {
+      result[i] = initialMemory[index[i]];
+    }
+    return result;
+#endif
+  }
+
+  // Reads the written value for each lane, or the random
+  // initial memory if the lane hasn't written the address.
+  u8x16 read(u16x16 addr) const {
+    u8x16 result = initial(addr);
+    for (int i = 0; i < maxAddressesWritten; i++) {
+      b8x16 hit = convert<b8x16>(writtenAddresses[i] == addr) & (numAddressesWritten > (uint8_t)i);
+      result = hit ? writtenValues[i] : result;
+    }
+    return result;
+  }
+
+  /**
+   * Returns the lanes where both machines are in the same state.
+   * Memory is compared by address, so the order of the writes
+   * doesn't matter. Both must start from the same initial machines.
+   */
+  b8x16 same_state(const random_machine_x16 &other) const {
+    b8x16 same = convert<b8x16>(earlyExit == other.earlyExit)
+      & (_a == other._a) & (_x == other._x) & (_y == other._y) & (_sp == other._sp)
+      & ~(_ccS ^ other._ccS) & ~(_ccV ^ other._ccV) & ~(_ccI ^ other._ccI)
+      & ~(_ccD ^ other._ccD) & ~(_ccC ^ other._ccC) & ~(_ccZ ^ other._ccZ);
+    for (const random_machine_x16 *m : { this, &other }) {
+      for (int i = 0; i < m->maxAddressesWritten; i++) {
+        b8x16 written = m->numAddressesWritten > (uint8_t)i;
+        same &= ~written | (read(m->writtenAddresses[i]) == other.read(m->writtenAddresses[i]));
+      }
+    }
+    return same;
+  }
+
+  u8x16 setSZ(u8x16 val) {
+    ccS(val >= 0x80);
+    ccZ(val == 0);
+    return val;
+  }
+
+  // Sets V for the addition of operand to a giving result.
+  b8x16 setV(u8x16 a, u8x16 operand, u8x16 result) {
+    return ccV(0x80 == (0x80 & (result ^ a) & (result ^ operand)));
+  }
+
+  b8x16 uge(u8x16 first, u8x16 second) const {
+    return first >= second;
+  }
+
+  b8x16 uge(u8x16 first, uint8_t second) const {
+    return first >= second;
+  }
+
+  u8x16 inline ite(b8x16 cond, u8x16 conseq, u8x16 alter) const {
+    return cond ? conseq : alter;
+  }
+
+  u8x16 inline ite(b8x16 cond, uint8_t conseq, uint8_t alter) const {
+    return cond ? u8x16{} + conseq : u8x16{} + alter;
+  }
+
+  u8x16 inline shl(const u8x16 val) const {
+    return val << 1;
+  }
+
+  u8x16 inline shr(const u8x16 val) const {
+    return val >> 1;
+  }
+
+  u8x16 inline lobyte(u16x16 val) const {
+    return convert<u8x16>(val);
+  }
+
+  u8x16 inline hibyte(u16x16 val) const {
+    return convert<u8x16>(val >> 8);
+  }
+
+  // Updates the lane's entry if it already wrote to the address,
+  // otherwise appends a new entry at the end of the lane's log.
+  u8x16 write(u16x16 addr, u8x16 val) {
+    b8x16 pending = live;
+    for (int i = 0; i < maxAddressesWritten; i++) {
+      b8x16 hit = pending & convert<b8x16>(writtenAddresses[i] == addr) & (numAddressesWritten > (uint8_t)i);
+      writtenValues[i] = hit ? val : writtenValues[i];
+      pending &= ~hit;
+    }
+    if (!any(pending)) {
+      return val;
+    }
+    // Unlike the scalar machine, there's nowhere to spill to. A
+    // sequence of the enumerator writes at most 7 addresses, so a full
+    // log means something else is running it.
+    if (any(pending & (numAddressesWritten == (uint8_t)NUM_ADDRESSES))) {
+      throw std::length_error("random_machine_x16 wrote more than NUM_ADDRESSES addresses");
+    }
+    for (int i = 0; i <= maxAddressesWritten && i < NUM_ADDRESSES; i++) {
+      b8x16 append = pending & (numAddressesWritten == (uint8_t)i);
+      writtenAddresses[i] = convert<b16x16>(append) ? addr : writtenAddresses[i];
+      writtenValues[i] = append ? val : writtenValues[i];
+    }
+    numAddressesWritten -= (u8x16)pending;
+    if (maxAddressesWritten < NUM_ADDRESSES) {
+      maxAddressesWritten++;
+    }
+    return val;
+  }
+
+  u16x16 extend(u8x16 val) const {
+    return convert<u16x16>(val);
+  }
+
+  /**
+   * Returns random_machine::hash() for each lane.
+   */
+  u32x16 hash() const {
+    u32x16 hash = u32x16{} + 2166136261;
+#define h(var) hash = (hash ^ (var)) * 16777619
+    h(convert<u32x16>(_a));
+    h(convert<u32x16>(_x));
+    h(convert<u32x16>(_y));
+    h(convert<u32x16>(_sp));
+    h(convert<u32x16>(_ccS) & 1);
+    h(convert<u32x16>(_ccV) & 1);
+    h(convert<u32x16>(_ccI) & 1);
+    h(convert<u32x16>(_ccD) & 1);
+    h(convert<u32x16>(_ccC) & 1);
+    h(convert<u32x16>(_ccZ) & 1);
+
+    hash = hash_memory(hash);
+    h(earlyExit);
+    return hash;
+  }
+
+  /**
+   * Like hash(), but only over the parts of the state that are live
+   * whatever code follows: the stack pointer, memory and the exit.
+   */
+  u32x16 hash_always_live() const {
+    u32x16 hash = u32x16{} + 2166136261;
+    h(convert<u32x16>(_sp));
+    hash = hash_memory(hash);
+    h(earlyExit);
+    return hash;
+  }
+
+  // For each changed address hash the address and value. An address
+  // written back to its initial value is unchanged, as in fingerprint().
+  u32x16 hash_memory(u32x16 hash) const {
+    for (int i = 0; i < maxAddressesWritten; i++) {
+      u32x16 address = convert<u32x16>(writtenAddresses[i]);
+      u32x16 value = convert<u32x16>(writtenValues[i]);
+      b32x16 changed = convert<b32x16>(numAddressesWritten > (uint8_t)i)
+        & (value != convert<u32x16>(initial(writtenAddresses[i])));
+      u32x16 hashed = hash;
+      h(address);
+      h(value);
+      hash = changed ? hash : hashed;
+    }
+    return hash;
+  }
+#undef h
+
+  // random_machine::packed_registers() for each lane.
+  u64x16 packed_registers() const {
+    return convert<u64x16>(_a) | convert<u64x16>(_x) << 8 | convert<u64x16>(_y) << 16 | convert<u64x16>(_sp) << 24
+      | (convert<u64x16>(_ccS) & 1) << 32 | (convert<u64x16>(_ccV) & 1) << 33 | (convert<u64x16>(_ccI) & 1) << 34
+      | (convert<u64x16>(_ccD) & 1) << 35 | (convert<u64x16>(_ccC) & 1) << 36 | (convert<u64x16>(_ccZ) & 1) << 37
+      | convert<u64x16>(earlyExit) << 40;
+  }
+
+  /**
+   * Returns random_machine::fingerprint() for each lane.
+   */
+  template<typename kernel>
+  u64x16 fingerprint(uint64_t seed = 0) const {
+    u64x16 hash = kernel::template start<u64x16>(seed);
+    hash = kernel::add(hash, packed_registers());
+    for (int i = 0; i < maxAddressesWritten; i++) {
+      u64x16 address = convert<u64x16>(writtenAddresses[i]);
+      u64x16 value = convert<u64x16>(writtenValues[i]);
+      b64x16 changed = convert<b64x16>(numAddressesWritten > (uint8_t)i)
+        & (value != convert<u64x16>(initial(writtenAddresses[i])));
+      hash = changed ? kernel::add(hash, address << 8 | value) : hash;
+    }
+    return kernel::finish(hash);
+  }
+
+  // The size of a saved state with no write log entries, and the
+  // size of each entry.
+  static constexpr int saved_header_size = 1 + 4 * lanes + 6 * 2 + 3 * lanes + lanes;
+  static constexpr int saved_entry_size = 3 * lanes;
+
+  /**
+   * Writes the parts of the state that instructions can change, so
+   * that a sequence can later be resumed from this point without
+   * running it again. The operands and initial memory aren't saved;
+   * load() expects to be called on a copy of the same initial machines.
+   *
+   * Only the write log entries in use are saved, so the size depends
+   * on the number of addresses written.
+   */
+  void save(std::ostream &out) const {
+    uint8_t buffer[saved_header_size + NUM_ADDRESSES * saved_entry_size];
+    uint8_t *p = buffer;
+    *p++ = maxAddressesWritten;
+    for (const u8x16 *reg : { &_a, &_x, &_y, &_sp }) {
+      memcpy(p, reg, lanes);
+      p += lanes;
+    }
+    for (const b8x16 *flag : { &_ccS, &_ccV, &_ccI, &_ccD, &_ccC, &_ccZ }) {
+      uint16_t bits = 0;
+      for (int i = 0; i < lanes; i++) {
+        bits |= ((*flag)[i] & 1) << i;
+      }
+      *p++ = bits;
+      *p++ = bits >> 8;
+    }
+    for (int i = 0; i < lanes; i++) {
+      *p++ = earlyExit[i];
+      *p++ = earlyExit[i] >> 8;
+      *p++ = earlyExit[i] >> 16;
+    }
+    memcpy(p, &numAddressesWritten, lanes);
+    p += lanes;
+    for (int slot = 0; slot < maxAddressesWritten; slot++) {
+      for (int i = 0; i < lanes; i++) {
+        *p++ = writtenAddresses[slot][i];
+        *p++ = writtenAddresses[slot][i] >> 8;
+      }
+      memcpy(p, &writtenValues[slot], lanes);
+      p += lanes;
+    }
+    out.write((const char*)buffer, p - buffer);
+  }
+
+  // Reads a state written by save(). Returns false at the end of the input.
+  bool load(std::istream &in) {
+    uint8_t buffer[saved_header_size + NUM_ADDRESSES * saved_entry_size];
+    in.read((char*)buffer, saved_header_size);
+    if (!in.good() || buffer[0] > NUM_ADDRESSES) { return false; }
+    in.read((char*)buffer + saved_header_size, buffer[0] * saved_entry_size);
+    if (!in.good()) { return false; }
+    load(buffer);
+    return true;
+  }
+
+  // The size of the saved state that starts at buffer, or 0 if the
+  // size is more than available or it isn't a saved state.
+  static size_t saved_size(const uint8_t *buffer, size_t available) {
+    if (available < saved_header_size || buffer[0] > NUM_ADDRESSES) { return 0; }
+    size_t size = saved_header_size + buffer[0] * saved_entry_size;
+    return size <= available ? size : 0;
+  }
+
+  // Reads a state written by save() from memory that's been checked
+  // with saved_size().
+  void load(const uint8_t *buffer) {
+    maxAddressesWritten = buffer[0];
+    const uint8_t *p = buffer + 1;
+    for (u8x16 *reg : { &_a, &_x, &_y, &_sp }) {
+      memcpy(reg, p, lanes);
+      p += lanes;
+    }
+    for (b8x16 *flag : { &_ccS, &_ccV, &_ccI, &_ccD, &_ccC, &_ccZ }) {
+      uint16_t bits = p[0] | (p[1] << 8);
+      p += 2;
+      for (int i = 0; i < lanes; i++) {
+        (*flag)[i] = ((bits >> i) & 1) ? -1 : 0;
+      }
+    }
+    for (int i = 0; i < lanes; i++) {
+      earlyExit[i] = p[0] | (p[1] << 8) | (p[2] << 16);
+      p += 3;
+    }
+    live = convert<b8x16>(earlyExit == 0);
+    memcpy(&numAddressesWritten, p, lanes);
+    p += lanes;
+    for (int slot = 0; slot < maxAddressesWritten; slot++) {
+      for (int i = 0; i < lanes; i++) {
+        writtenAddresses[slot][i] = p[0] | (p[1] << 8);
+        p += 2;
+      }
+      memcpy(&writtenValues[slot], p, lanes);
+      p += lanes;
+    }
+  }
+};
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "stdint.h"
+#include "string.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX512F__
+#include <immintrin.h>
+#endif
+
+/**
+ * Vector types used to run 16 machines side by side. These use the
+ * gcc/clang vector extensions, so the same code compiles to SSE2 on any
+ * x86-64 and to AVX2 when built with -march=native.
+ *
+ * The b* types are lane masks: each lane is either 0 (false) or -1 (true),
+ * which is what the vector comparison operators produce.
+ */
+typedef uint8_t  u8x16  __attribute__((vector_size(16)));
+typedef int8_t   b8x16  __attribute__((vector_size(16)));
+typedef uint16_t u16x16 __attribute__((vector_size(32)));
+typedef int16_t  b16x16 __attribute__((vector_size(32)));
+typedef uint32_t u32x16 __attribute__((vector_size(64)));
+typedef int32_t  b32x16 __attribute__((vector_size(64)));
+typedef uint64_t u64x16 __attribute__((vector_size(128)));
+typedef int64_t  b64x16 __attribute__((vector_size(128)));
+
+template<typename to, typename from>
+inline to convert(const from &val) {
+  return __builtin_convertvector(val, to);
+}
+
+// Bit i of the result is set if lane i of the mask is set.
+inline uint32_t movemask(const b8x16 &mask) {
+#ifdef __SSE2__
+  return _mm_movemask_epi8((__m128i)mask);
+#else
+  uint32_t bits = 0;
+  for (int i = 0; i < 16; i++) {
+    bits |= (mask[i] & 1) << i;
+  }
+  return bits;
+#endif
+}
+
+// True if any lane of the mask is set.
+inline bool any(const b8x16 &mask) {
+  return movemask(mask) != 0;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "stdint.h"
+
+/**
+ * Kernels that hash the state of a machine, given to them as a list
+ * of 64-bit words. They're written with operators only, so the same
+ * kernel hashes one machine with uint64_t or 16 at once with u64x16.
+ *
+ * A kernel has:
+ *   start<T>(seed)      the hash before any words
+ *   add<T>(hash, word)  the hash with one more word
+ *   finish<T>(hash)     the hash to use
+ */
+
+// FNV-1a, but taking a whole word for each multiply instead of a byte.
+// The high bits of a word only reach the high bits of the hash.
+typedef struct fnv_kernel {
+  template<typename T>
+  static T start(uint64_t seed) {
+    return (T{} + 14695981039346656037u) ^ seed;
+  }
+
+  template<typename T>
+  static T add(const T &hash, const T &word) {
+    return (hash ^ word) * 1099511628211u;
+  }
+
+  template<typename T>
+  static T finish(const T &hash) {
+    return hash;
+  }
+} fnv_kernel;
+
+// A multiply and xorshift for each word, then the murmur3 finalizer,
+// so that every bit of every word reaches every bit of the hash.
+typedef struct mix_kernel {
+  template<typename T>
+  static T start(uint64_t seed) {
+    return T{} + (seed ^ 0x9E3779B97F4A7C15u);
+  }
+
+  template<typename T>
+  static T add(const T &hash, const T &word) {
+    T mixed = (hash ^ word) * 0xBF58476D1CE4E5B9u;
+    return mixed ^ (mixed >> 31);
+  }
+
+  template<typename T>
+  static T finish(const T &hash) {
+    T mixed = (hash ^ (hash >> 33)) * 0xFF51AFD7ED558CCDu;
+    mixed = (mixed ^ (mixed >> 33)) * 0xC4CEB9FE1A85EC53u;
+    return mixed ^ (mixed >> 33);
+  }
+} mix_kernel;